@@ -0,0 +1,367 @@
+// Instruction set template, included once per quirk profile by chip8_interpretor.c.
+// Before including, define :
+//   QUIRK_FN_SUFFIX         name suffix of the generated functions
+//   QUIRK_SHIFT_VY          8XY6/8XYE shift VY into VX instead of VX in place
+//   QUIRK_LOAD_STORE_INC_I  FX55/FX65 leave I incremented by X + 1
+//   QUIRK_JUMP_VX           BXNN jumps to XNN + VX instead of BNNN to NNN + V0
+//   QUIRK_SPRITE_WRAP       sprites wrap around the screen edges instead of being clipped
+//   QUIRK_VF_RESET          8XY1/8XY2/8XY3 reset VF to 0
+// Every quirk is resolved by the preprocessor, the generated loops have no quirk branching.
+// This file has no include guard on purpose.
+
+#define QUIRK_CONCAT_(a, b) a##b
+#define QUIRK_CONCAT(a, b) QUIRK_CONCAT_(a, b)
+#define QUIRK_FN(name) QUIRK_CONCAT(name, QUIRK_FN_SUFFIX)
+
+#if QUIRK_SPRITE_WRAP
+	#define SPRITE_NEXT_X() X_coord = (X_coord + 1) % chip8->width
+	#define SPRITE_NEXT_Y() Y_coord = (Y_coord + 1) % chip8->height
+#else
+	#define SPRITE_NEXT_X() if(++X_coord >= chip8->width) break
+	#define SPRITE_NEXT_Y() if(++Y_coord >= chip8->height) break
+#endif
+
+static inline void QUIRK_FN(emulate_instruction_inline_)(chip8_t *chip8, config_t config){
+	(void)config;  // Resolution and mode live in chip8_t
+	bool carry;
+	decode_instruction(&chip8->inst, (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC+1]);
+	chip8->PC += 2;
+
+#ifdef DEBUG
+	print_debug_info(chip8);
+#endif
+
+	switch ((chip8->inst.opcode >> 12) & 0x0F){
+		case 0x00:
+			if(chip8->inst.X != 0) break;  // 0NNN machine code routines are ignored
+			if(chip8->inst.NN == 0xE0){
+				memset(&chip8->display[0], false, sizeof chip8->display);
+			} else if(chip8->inst.NN == 0xEE){
+				chip8->PC = *--chip8->stack_ptr;
+			} else if(chip8->inst.N2 == 0x0C0){
+				for(int loop = 0; loop < 8192; loop++){
+					chip8->Destination[loop] = 0;
+				}
+				for(unsigned col = 0; col < chip8->width; col++){
+					for(unsigned row = 0; row < (chip8->height - chip8->inst.N); row++){
+						int source = col + (row * chip8->width);
+						int dest = col + ((row + chip8->inst.N) * chip8->width);
+						chip8->Destination[dest] = chip8->display[source];
+					}
+				}
+				for(int i = 0; i < 8192; i++){
+					chip8->display[i] = chip8->Destination[i];
+				}
+			} else if(chip8->inst.NN == 0xFB){
+				for(int loop = 0; loop < 8192; loop++){
+					chip8->Destination[loop] = 0;
+				}
+				for(unsigned col = 0; col < chip8->width - 4; col++){
+					for(unsigned row = 0; row < (chip8->height); row++){
+						int source = col + (row * chip8->width);
+						int dest = (col + 4) + (row * chip8->width);
+						chip8->Destination[dest] = chip8->display[source];
+					}
+				}
+				for(int i = 0; i < 8192; i++){
+					chip8->display[i] = chip8->Destination[i];
+				}
+			} else if (chip8->inst.NN == 0xFC){
+				for(int loop = 0; loop < 8192; loop++){
+					chip8->Destination[loop] = 0;
+				}
+				for(unsigned col = 4; col < chip8->width; col++){
+					for(unsigned row = 0; row < (chip8->height); row++){
+						int source = col + (row * chip8->width);
+						int dest = (col - 4) + (row * chip8->width);
+						chip8->Destination[dest] = chip8->display[source];
+					}
+				}
+				for(int i = 0; i < 8192; i++){
+					chip8->display[i] = chip8->Destination[i];
+				}
+			} else if(chip8->inst.NN == 0xFE){
+				chip8->super_mode = false;
+				chip8->height = 32;
+				chip8->width = 64;
+				memset(&chip8->display[0], false, sizeof chip8->display);
+			} else if(chip8->inst.NN == 0xFF){
+				chip8->super_mode = true;
+				chip8->height = 64;
+				chip8->width = 128;
+				memset(&chip8->display[0], false, sizeof chip8->display);
+			} else if(chip8->inst.NN == 0xFD){
+				// Stay on the exit instruction and let main do the cleanup
+				chip8->state = QUIT;
+				chip8->PC -= 2;
+			}
+			break;
+		case 0x01:
+			chip8->PC = chip8->inst.NNN;
+			break;
+		case 0x02:
+			*chip8->stack_ptr++ = chip8->PC;
+			chip8->PC = chip8->inst.NNN;
+			break;
+		case 0x03:
+			if(chip8->V[chip8->inst.X] == chip8->inst.NN){
+				chip8->PC += 2;
+			}
+			break;
+		case 0x04:
+			if(chip8->V[chip8->inst.X] != chip8->inst.NN){
+				chip8->PC += 2;
+			}
+			break;
+		case 0x05:
+			if(chip8->inst.N != 0) break;
+			if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]){
+				chip8->PC += 2;
+			}
+			break;
+		case 0x06:
+			chip8->V[chip8->inst.X] = chip8->inst.NN;
+			break;
+		case 0x07:
+			chip8->V[chip8->inst.X] += chip8->inst.NN;
+			break;
+		case 0x08:
+			switch (chip8->inst.N){
+				case 0:
+					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+					break;
+				case 1:
+					chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+#if QUIRK_VF_RESET
+					chip8->V[0xF] = 0;
+#endif
+					break;
+				case 2:
+					chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+#if QUIRK_VF_RESET
+					chip8->V[0xF] = 0;
+#endif
+					break;
+				case 3:
+					chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+#if QUIRK_VF_RESET
+					chip8->V[0xF] = 0;
+#endif
+					break;
+				case 4:{
+					const bool carry = ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255);
+					chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+					chip8->V[0xF] = carry;
+					break;
+				}
+				case 5:
+					carry = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
+					chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+					chip8->V[0xF] = carry;
+					break;
+				case 6:
+#if QUIRK_SHIFT_VY
+					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+#endif
+					carry = chip8->V[chip8->inst.X] & 1;
+					chip8->V[chip8->inst.X] >>= 1;
+					chip8->V[0xF] = carry;
+					break;
+				case 7:
+					carry = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
+					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
+					chip8->V[0xF] = carry;
+					break;
+				case 0xE:
+#if QUIRK_SHIFT_VY
+					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+#endif
+					carry = (chip8->V[chip8->inst.X] & 0x80) >> 7;
+					chip8->V[chip8->inst.X] <<= 1;
+					chip8->V[0xF] = carry;
+					break;
+				default:
+					break;
+			}
+			break;
+		case 0x09:
+			if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
+				chip8->PC += 2;
+			break;
+		case 0x0A:
+			chip8->I = chip8->inst.NNN;
+			break;
+		case 0x0B:
+#if QUIRK_JUMP_VX
+			chip8->PC = chip8->V[chip8->inst.X] + chip8->inst.NNN;
+#else
+			chip8->PC = chip8->V[0] + chip8->inst.NNN;
+#endif
+			break;
+		case 0x0C:
+			chip8->random = chip8->random * 1103515245 + 12345;
+			chip8->V[chip8->inst.X] = (chip8->random >> 16) & chip8->inst.NN;
+			break;
+		case 0x0D: {
+			chip8->draws++;
+			uint8_t X_coord = chip8->V[chip8->inst.X] % chip8->width;
+			uint8_t Y_coord = chip8->V[chip8->inst.Y] % chip8->height;
+			const uint8_t orig_X = X_coord;
+
+			chip8->V[0xF] = 0;
+			if(chip8->super_mode == false){
+				for(uint8_t i = 0; i < chip8->inst.N; i++){
+					const uint8_t sprite_data = chip8->ram[chip8->I + i];
+					X_coord = orig_X;
+				
+					for(int8_t j = 7; j >= 0; j--){
+						bool *pixel = &chip8->display[Y_coord * chip8->width + X_coord];
+						const bool sprite_bit = (sprite_data & (1 << j));
+						if(sprite_bit && *pixel){
+							chip8->V[0xF] = 1;
+						}
+						*pixel ^= sprite_bit;
+
+						SPRITE_NEXT_X();
+					}
+					SPRITE_NEXT_Y();
+				}
+			} else if(chip8->super_mode == true){ 
+				if(chip8->inst.N == 0){
+					int offset = 0;
+					for(uint8_t i = 0; i < 16; i++){
+						const uint16_t sprite_data = (chip8->ram[chip8->I + offset] * 256) + (chip8->ram[chip8->I + (offset + 1)]);
+						offset += 2;
+						X_coord = orig_X;
+				
+						for(int8_t j = 0; j <16; j++){
+							bool *pixel = &chip8->display[Y_coord * chip8->width + X_coord];
+							const bool sprite_bit = (sprite_data & (0x8000 >> j));
+							if(sprite_bit && *pixel){
+								chip8->V[0xF] = 1;
+							}
+							*pixel ^= sprite_bit;
+
+							SPRITE_NEXT_X();
+						}
+						SPRITE_NEXT_Y();
+					}
+				} else {
+					for(uint8_t i = 0; i < chip8->inst.N; i++){
+					const uint8_t sprite_data = chip8->ram[chip8->I + i];
+					X_coord = orig_X;
+				
+						for(int8_t j = 7; j >= 0; j--){
+							bool *pixel = &chip8->display[Y_coord * chip8->width + X_coord];
+							const bool sprite_bit = (sprite_data & (1 << j));
+							if(sprite_bit && *pixel){
+								chip8->V[0xF] = 1;
+							}
+							*pixel ^= sprite_bit;
+
+							SPRITE_NEXT_X();
+						}
+						SPRITE_NEXT_Y();
+					}
+				}
+			}
+			break;
+		}
+		case 0x0E:
+			if(chip8->inst.NN == 0x9E){
+				if(chip8->keypad[chip8->V[chip8->inst.X] & 0xF])
+					chip8->PC += 2;
+			} else if(chip8->inst.NN == 0xA1){
+				if(!chip8->keypad[chip8->V[chip8->inst.X] & 0xF])
+					chip8->PC += 2;
+			}
+			break;
+		case 0x0F:
+			switch (chip8->inst.NN) {
+				case 0x0A: {
+					bool any_key_pressed = false;
+					for(uint8_t i = 0; i < sizeof chip8->keypad; i++){
+						if(chip8->keypad[i]){
+							chip8->V[chip8->inst.X] = i;
+							any_key_pressed = true;
+							break;
+						}
+					}
+					if(!any_key_pressed)
+						chip8->PC -= 2;
+					break;
+				}
+				case 0x1E:
+					chip8->I += chip8->V[chip8->inst.X];
+					break;
+				case 0x07:
+					chip8->V[chip8->inst.X] = chip8->delay_timer;
+					break;
+				case 0x15:
+					chip8->stores++;
+					chip8->delay_timer = chip8->V[chip8->inst.X];
+					break;
+				case 0x18:
+					chip8->stores++;
+					chip8->sound_timer = chip8->V[chip8->inst.X];
+					break;
+				case 0x29:
+					chip8->I = chip8->V[chip8->inst.X] * 5;
+					break;
+				case 0x30:
+					chip8->I = 80 + chip8->V[chip8->inst.X] * 10;
+					break;
+				case 0x33: {
+					chip8->stores++;
+					uint8_t bcd = chip8->V[chip8->inst.X];
+					chip8->ram[chip8->I+2] = bcd % 10;
+					bcd /= 10;
+					chip8->ram[chip8->I+1] = bcd % 10;
+					bcd /= 10;
+					chip8->ram[chip8->I] = bcd;
+					break;
+				}
+				case 0x55:
+					chip8->stores++;
+					for(uint8_t i = 0; i <= chip8->inst.X; i++)
+						chip8->ram[chip8->I + i] = chip8->V[i];
+#if QUIRK_LOAD_STORE_INC_I
+					chip8->I += chip8->inst.X + 1;
+#endif
+					break;
+				case 0x65:
+					for(uint8_t i = 0; i <= chip8->inst.X; i++)
+						chip8->V[i] = chip8->ram[chip8->I + i];
+#if QUIRK_LOAD_STORE_INC_I
+					chip8->I += chip8->inst.X + 1;
+#endif
+					break;
+				default:
+					break;
+			}
+			break;
+		default :
+			break;
+	}
+}
+
+void QUIRK_FN(emulate_instruction_)(chip8_t *chip8, config_t config){
+	QUIRK_FN(emulate_instruction_inline_)(chip8, config);
+}
+
+void QUIRK_FN(emulate_instructions_)(chip8_t *chip8, config_t config, uint32_t count){
+	while(count--)
+		QUIRK_FN(emulate_instruction_inline_)(chip8, config);
+}
+
+#undef SPRITE_NEXT_X
+#undef SPRITE_NEXT_Y
+#undef QUIRK_FN
+#undef QUIRK_CONCAT
+#undef QUIRK_CONCAT_
+#undef QUIRK_FN_SUFFIX
+#undef QUIRK_SHIFT_VY
+#undef QUIRK_LOAD_STORE_INC_I
+#undef QUIRK_JUMP_VX
+#undef QUIRK_SPRITE_WRAP
+#undef QUIRK_VF_RESET
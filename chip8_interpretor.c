@@ -1,23 +1,78 @@
+#ifndef _WIN32
+	#define _POSIX_C_SOURCE 200809L  // ftruncate, shm_open and friends under -std=c11
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+	#include <errno.h>
+	#include <signal.h>
+	#include <poll.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+#endif
+#ifdef __linux__
+	#include <sys/inotify.h>
+#endif
 
 #include "SDL.h"
+#include "chip8_metrics.h"
+#include "chip8_server.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define UPSCALE_X86
+#endif
 
 typedef struct {
 	SDL_Window *window;
 	SDL_Renderer *renderer;
 	SDL_AudioSpec want, have;
 	SDL_AudioDeviceID dev;
+	uint32_t refresh_rate;  // Hz, 0 if unknown
+	SDL_Texture *texture;   // Upscaled frame, sized for the biggest resolution and filter
 } sdl_t;
 
+typedef enum {
+	QUIRKS_DEFAULT,
+	QUIRKS_CHIP8,
+	QUIRKS_SCHIP,
+	QUIRKS_XOCHIP,
+	QUIRKS_COUNT,
+} quirks_t;
+
+typedef enum {
+	UPSCALE_NONE,
+	UPSCALE_SCALE2X,
+	UPSCALE_SCALE3X,
+	UPSCALE_SCALE4X,
+	UPSCALE_COUNT,
+} upscale_t;
+
+typedef enum {
+	CRT_OFF,
+	CRT_SCANLINES,
+	CRT_MASK,
+	CRT_COUNT,
+} crt_t;
+
+typedef enum {
+	PACING_VSYNC,
+	PACING_HYBRID,
+} pacing_t;
+
 typedef struct {
-	uint32_t window_width;
-	uint32_t window_height;
-	bool super_mode;
 	uint32_t fg_color;
 	uint32_t bg_color;
 	uint32_t scale_factor;
@@ -27,12 +82,22 @@ typedef struct {
 	uint32_t audio_sample_rate;
 	int16_t volume;
 	float color_lerp_rate;
+	const char *trace_path;
+	const char *record_path;
+	quirks_t quirks;
+	pacing_t pacing;
+	bool show_overlay;
+	bool debug;     // Start stopped in the debugger
+	bool remember;  // Save --ips and --quirks as this ROM's defaults
+	upscale_t upscale;
+	crt_t crt;
 } config_t;
 
 typedef enum {
 	QUIT,
 	RUNNING,
 	PAUSED,
+	STOPPED,  // In the debugger
 } emulator_state_t;
 
 typedef struct {
@@ -48,9 +113,9 @@ typedef struct {
 typedef struct {
 	emulator_state_t state;
 	uint8_t ram[4096];  // 32768 for SCHIP
-	bool display[64*32];
+	bool display[128*64];
 	char Destination[8192];
-	uint32_t pixel_color[64*32];
+	uint32_t pixel_color[128*64];
 	uint16_t stack[12];
 	uint16_t *stack_ptr;
 	uint8_t V[16];
@@ -59,10 +124,34 @@ typedef struct {
 	uint8_t delay_timer;
 	uint8_t sound_timer;
 	bool keypad[16];
-	const char *rom_name;
+	const struct rom *rom;
 	instruction_t inst;
+	uint32_t draws;       // DXYN executed since main last collected them
+	uint32_t stores;      // Timer and memory writes (FX15, FX18, FX33, FX55) executed
+	uint32_t random;      // CXNN generator, one per machine so a run can be replayed from its seed
+	uint32_t width;       // Current resolution, 64x32 or 128x64 after 00FF
+	uint32_t height;
+	bool super_mode;
 } chip8_t;
 
+typedef struct {
+	const char *name;
+	void (*emulate_instruction)(chip8_t *chip8, config_t config);
+	void (*emulate_instructions)(chip8_t *chip8, config_t config, uint32_t count);
+} quirk_profile_t;
+
+extern const quirk_profile_t quirk_profiles[QUIRKS_COUNT];
+
+void decode_instruction(instruction_t *inst, const uint16_t opcode){
+	inst->opcode = opcode;
+	inst->NNN = opcode & 0x0FFF;
+	inst->NN = opcode & 0x0FF;
+	inst->N = opcode & 0x0F;
+	inst->N2 = opcode & 0x00F0;
+	inst->X = (opcode >> 8) & 0x0F;
+	inst->Y = (opcode >> 4) & 0x0F;
+}
+
 uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, float t){
 	const uint8_t s_r = (start_color >> 24) & 0xFF;
 	const uint8_t s_g = (start_color >> 16) & 0xFF;
@@ -82,19 +171,423 @@ uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, float
 	return (ret_r << 24) | (ret_g << 16) | (ret_b << 8) | ret_a;
 }
 
+// Shared with the audio thread
+atomic_bool audio_restarted;          // Set when the device is unpaused, callbacks were not due meanwhile
+atomic_uint_fast64_t audio_underruns; // Callbacks that came in too late to keep the buffer full
+
 void audio_callback(void *userdata, uint8_t *stream, int len){
 	config_t *config = (config_t *)userdata;
 	int16_t *audio_data = (int16_t *)stream;
 	static uint32_t running_sample_index = 0;
+	static uint64_t last_callback = 0;
 	const int32_t square_wave_period = config->audio_sample_rate / config->square_wave_freq;
 	const int32_t half_square_wave_period = square_wave_period / 2;
 
+	// A callback more than 1.5 buffer late means the device ran dry
+	const uint64_t now = SDL_GetPerformanceCounter();
+	const uint64_t buffer_ticks = SDL_GetPerformanceFrequency() * (len/2) / config->audio_sample_rate;
+	if(atomic_exchange_explicit(&audio_restarted, false, memory_order_relaxed)) last_callback = 0;
+	if(last_callback && now - last_callback > buffer_ticks * 3 / 2)
+		atomic_fetch_add_explicit(&audio_underruns, 1, memory_order_relaxed);
+	last_callback = now;
+
 	for(int i = 0; i < len/2; i++){
 		audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ? 
 						config->volume : -config->volume;
 	}
 }
 
+// Software upscaling
+// The CHIP8 colors are scaled into one streaming texture by Scale2x/Scale3x (Scale4x is Scale2x
+// applied twice), optionally followed by scanlines or a CRT aperture mask. SDL then only has to
+// stretch that texture to the window, whatever its size. Rows are processed 4 pixels at a time
+// with SSE2 or 8 with AVX2 when the CPU has them, with a scalar fallback.
+#define UPSCALE_MAX_FACTOR 4
+#define UPSCALE_MAX_WIDTH (128 * UPSCALE_MAX_FACTOR)
+#define UPSCALE_MAX_HEIGHT (64 * UPSCALE_MAX_FACTOR)
+
+typedef void (*scale2x_row_t)(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+							  uint32_t *out0, uint32_t *out1, uint32_t width);
+typedef void (*scale3x_row_t)(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+							  uint32_t *out0, uint32_t *out1, uint32_t *out2, uint32_t width);
+typedef void (*crt_row_t)(uint32_t *row, uint32_t width, bool scanline, bool mask);
+
+// Rows below point to the first pixel of a row padded by one replicated pixel on each side
+void scale2x_row_scalar(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+						uint32_t *out0, uint32_t *out1, const uint32_t width){
+	for(uint32_t x = 0; x < width; x++){
+		// x is unsigned, step back through the pointer to reach the left padding
+		const uint32_t B = above[x], D = (&row[x])[-1], E = row[x], F = row[x+1], H = below[x];
+		const bool edge = B != H && D != F;
+		out0[x*2]   = edge && D == B ? D : E;
+		out0[x*2+1] = edge && B == F ? F : E;
+		out1[x*2]   = edge && D == H ? D : E;
+		out1[x*2+1] = edge && H == F ? F : E;
+	}
+}
+
+void scale3x_row_scalar(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+						uint32_t *out0, uint32_t *out1, uint32_t *out2, const uint32_t width){
+	for(uint32_t x = 0; x < width; x++){
+		const uint32_t A = (&above[x])[-1], B = above[x], C = above[x+1];
+		const uint32_t D = (&row[x])[-1], E = row[x], F = row[x+1];
+		const uint32_t G = (&below[x])[-1], H = below[x], I = below[x+1];
+		if(B != H && D != F){
+			out0[x*3]   = D == B ? D : E;
+			out0[x*3+1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+			out0[x*3+2] = B == F ? F : E;
+			out1[x*3]   = (D == B && E != G) || (D == H && E != A) ? D : E;
+			out1[x*3+1] = E;
+			out1[x*3+2] = (B == F && E != I) || (H == F && E != C) ? F : E;
+			out2[x*3]   = D == H ? D : E;
+			out2[x*3+1] = (D == H && E != I) || (H == F && E != G) ? H : E;
+			out2[x*3+2] = H == F ? F : E;
+		} else {
+			out0[x*3] = out0[x*3+1] = out0[x*3+2] = E;
+			out1[x*3] = out1[x*3+1] = out1[x*3+2] = E;
+			out2[x*3] = out2[x*3+1] = out2[x*3+2] = E;
+		}
+	}
+}
+
+// Scanlines halve the last output row of every CHIP8 pixel, the aperture mask halves two of the
+// three color channels depending on the column
+static inline uint32_t crt_pixel(uint32_t pixel, const uint32_t x, const bool scanline, const bool mask){
+	static const uint32_t keep[3] = {0xFF0000FF, 0x00FF00FF, 0x0000FFFF};
+	if(mask) pixel = (pixel & keep[x % 3]) | (((pixel >> 1) & 0x7F7F7F7F) & ~keep[x % 3]);
+	if(scanline) pixel = ((pixel >> 1) & 0x7F7F7F00) | (pixel & 0xFF);
+	return pixel;
+}
+
+void crt_row_scalar(uint32_t *row, const uint32_t width, const bool scanline, const bool mask){
+	for(uint32_t x = 0; x < width; x++)
+		row[x] = crt_pixel(row[x], x, scanline, mask);
+}
+
+#ifdef UPSCALE_X86
+__attribute__((target("sse2")))
+void scale2x_row_sse2(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+					  uint32_t *out0, uint32_t *out1, const uint32_t width){
+	uint32_t x = 0;
+	for(; x + 4 <= width; x += 4){
+		const __m128i B = _mm_loadu_si128((const __m128i *)&above[x]);
+		const __m128i D = _mm_loadu_si128((const __m128i *)(&row[x] - 1));
+		const __m128i E = _mm_loadu_si128((const __m128i *)&row[x]);
+		const __m128i F = _mm_loadu_si128((const __m128i *)(&row[x] + 1));
+		const __m128i H = _mm_loadu_si128((const __m128i *)&below[x]);
+
+		// edge = B != H && D != F
+		const __m128i edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(B, H), _mm_cmpeq_epi32(D, F)), _mm_set1_epi32(-1));
+		const __m128i m0 = _mm_and_si128(edge, _mm_cmpeq_epi32(D, B));
+		const __m128i m1 = _mm_and_si128(edge, _mm_cmpeq_epi32(B, F));
+		const __m128i m2 = _mm_and_si128(edge, _mm_cmpeq_epi32(D, H));
+		const __m128i m3 = _mm_and_si128(edge, _mm_cmpeq_epi32(H, F));
+		const __m128i E0 = _mm_or_si128(_mm_and_si128(m0, D), _mm_andnot_si128(m0, E));
+		const __m128i E1 = _mm_or_si128(_mm_and_si128(m1, F), _mm_andnot_si128(m1, E));
+		const __m128i E2 = _mm_or_si128(_mm_and_si128(m2, D), _mm_andnot_si128(m2, E));
+		const __m128i E3 = _mm_or_si128(_mm_and_si128(m3, F), _mm_andnot_si128(m3, E));
+
+		_mm_storeu_si128((__m128i *)&out0[x*2], _mm_unpacklo_epi32(E0, E1));
+		_mm_storeu_si128((__m128i *)&out0[x*2+4], _mm_unpackhi_epi32(E0, E1));
+		_mm_storeu_si128((__m128i *)&out1[x*2], _mm_unpacklo_epi32(E2, E3));
+		_mm_storeu_si128((__m128i *)&out1[x*2+4], _mm_unpackhi_epi32(E2, E3));
+	}
+	if(x < width)
+		scale2x_row_scalar(&above[x], &row[x], &below[x], &out0[x*2], &out1[x*2], width - x);
+}
+
+__attribute__((target("avx2")))
+void scale2x_row_avx2(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+					  uint32_t *out0, uint32_t *out1, const uint32_t width){
+	uint32_t x = 0;
+	for(; x + 8 <= width; x += 8){
+		const __m256i B = _mm256_loadu_si256((const __m256i *)&above[x]);
+		const __m256i D = _mm256_loadu_si256((const __m256i *)(&row[x] - 1));
+		const __m256i E = _mm256_loadu_si256((const __m256i *)&row[x]);
+		const __m256i F = _mm256_loadu_si256((const __m256i *)(&row[x] + 1));
+		const __m256i H = _mm256_loadu_si256((const __m256i *)&below[x]);
+
+		const __m256i edge = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi32(B, H), _mm256_cmpeq_epi32(D, F)), _mm256_set1_epi32(-1));
+		const __m256i E0 = _mm256_blendv_epi8(E, D, _mm256_and_si256(edge, _mm256_cmpeq_epi32(D, B)));
+		const __m256i E1 = _mm256_blendv_epi8(E, F, _mm256_and_si256(edge, _mm256_cmpeq_epi32(B, F)));
+		const __m256i E2 = _mm256_blendv_epi8(E, D, _mm256_and_si256(edge, _mm256_cmpeq_epi32(D, H)));
+		const __m256i E3 = _mm256_blendv_epi8(E, F, _mm256_and_si256(edge, _mm256_cmpeq_epi32(H, F)));
+
+		// unpack works inside 128 bit lanes, put the halves back in order
+		const __m256i lo01 = _mm256_unpacklo_epi32(E0, E1), hi01 = _mm256_unpackhi_epi32(E0, E1);
+		const __m256i lo23 = _mm256_unpacklo_epi32(E2, E3), hi23 = _mm256_unpackhi_epi32(E2, E3);
+		_mm256_storeu_si256((__m256i *)&out0[x*2], _mm256_permute2x128_si256(lo01, hi01, 0x20));
+		_mm256_storeu_si256((__m256i *)&out0[x*2+8], _mm256_permute2x128_si256(lo01, hi01, 0x31));
+		_mm256_storeu_si256((__m256i *)&out1[x*2], _mm256_permute2x128_si256(lo23, hi23, 0x20));
+		_mm256_storeu_si256((__m256i *)&out1[x*2+8], _mm256_permute2x128_si256(lo23, hi23, 0x31));
+	}
+	if(x < width)
+		scale2x_row_scalar(&above[x], &row[x], &below[x], &out0[x*2], &out1[x*2], width - x);
+}
+
+__attribute__((target("sse2")))
+void scale3x_row_sse2(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+					  uint32_t *out0, uint32_t *out1, uint32_t *out2, const uint32_t width){
+	uint32_t x = 0;
+	for(; x + 4 <= width; x += 4){
+		const __m128i A = _mm_loadu_si128((const __m128i *)(&above[x] - 1));
+		const __m128i B = _mm_loadu_si128((const __m128i *)&above[x]);
+		const __m128i C = _mm_loadu_si128((const __m128i *)(&above[x] + 1));
+		const __m128i D = _mm_loadu_si128((const __m128i *)(&row[x] - 1));
+		const __m128i E = _mm_loadu_si128((const __m128i *)&row[x]);
+		const __m128i F = _mm_loadu_si128((const __m128i *)(&row[x] + 1));
+		const __m128i G = _mm_loadu_si128((const __m128i *)(&below[x] - 1));
+		const __m128i H = _mm_loadu_si128((const __m128i *)&below[x]);
+		const __m128i I = _mm_loadu_si128((const __m128i *)(&below[x] + 1));
+		const __m128i ones = _mm_set1_epi32(-1);
+
+		const __m128i edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(B, H), _mm_cmpeq_epi32(D, F)), ones);
+		const __m128i DB = _mm_and_si128(edge, _mm_cmpeq_epi32(D, B));
+		const __m128i BF = _mm_and_si128(edge, _mm_cmpeq_epi32(B, F));
+		const __m128i DH = _mm_and_si128(edge, _mm_cmpeq_epi32(D, H));
+		const __m128i HF = _mm_and_si128(edge, _mm_cmpeq_epi32(H, F));
+		const __m128i nEA = _mm_andnot_si128(_mm_cmpeq_epi32(E, A), ones);
+		const __m128i nEC = _mm_andnot_si128(_mm_cmpeq_epi32(E, C), ones);
+		const __m128i nEG = _mm_andnot_si128(_mm_cmpeq_epi32(E, G), ones);
+		const __m128i nEI = _mm_andnot_si128(_mm_cmpeq_epi32(E, I), ones);
+
+		#define SELECT(m, a) _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, E))
+		uint32_t out[9][4];
+		_mm_storeu_si128((__m128i *)out[0], SELECT(DB, D));
+		_mm_storeu_si128((__m128i *)out[1], SELECT(_mm_or_si128(_mm_and_si128(DB, nEC), _mm_and_si128(BF, nEA)), B));
+		_mm_storeu_si128((__m128i *)out[2], SELECT(BF, F));
+		_mm_storeu_si128((__m128i *)out[3], SELECT(_mm_or_si128(_mm_and_si128(DB, nEG), _mm_and_si128(DH, nEA)), D));
+		_mm_storeu_si128((__m128i *)out[4], E);
+		_mm_storeu_si128((__m128i *)out[5], SELECT(_mm_or_si128(_mm_and_si128(BF, nEI), _mm_and_si128(HF, nEC)), F));
+		_mm_storeu_si128((__m128i *)out[6], SELECT(DH, D));
+		_mm_storeu_si128((__m128i *)out[7], SELECT(_mm_or_si128(_mm_and_si128(DH, nEI), _mm_and_si128(HF, nEG)), H));
+		_mm_storeu_si128((__m128i *)out[8], SELECT(HF, F));
+		#undef SELECT
+
+		// No 3 way unpack, interleave the results through memory
+		for(uint32_t i = 0; i < 4; i++){
+			uint32_t *dst0 = &out0[(x + i) * 3], *dst1 = &out1[(x + i) * 3], *dst2 = &out2[(x + i) * 3];
+			dst0[0] = out[0][i]; dst0[1] = out[1][i]; dst0[2] = out[2][i];
+			dst1[0] = out[3][i]; dst1[1] = out[4][i]; dst1[2] = out[5][i];
+			dst2[0] = out[6][i]; dst2[1] = out[7][i]; dst2[2] = out[8][i];
+		}
+	}
+	if(x < width)
+		scale3x_row_scalar(&above[x], &row[x], &below[x], &out0[x*3], &out1[x*3], &out2[x*3], width - x);
+}
+
+// 3 way interleave of 8 pixels from a, b and c into dst[0..23] : a0 b0 c0 a1 b1 c1 ...
+__attribute__((target("avx2")))
+static inline void store_interleaved3_avx2(uint32_t *dst, const __m256i a, const __m256i b, const __m256i c){
+	const __m256i lanes[3] = {
+		_mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2),
+		_mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5),
+		_mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7),
+	};
+	__m256i pa = _mm256_permutevar8x32_epi32(a, lanes[0]);
+	__m256i pb = _mm256_permutevar8x32_epi32(b, lanes[0]);
+	__m256i pc = _mm256_permutevar8x32_epi32(c, lanes[0]);
+	_mm256_storeu_si256((__m256i *)&dst[0], _mm256_blend_epi32(_mm256_blend_epi32(pa, pb, 0x92), pc, 0x24));
+	pa = _mm256_permutevar8x32_epi32(a, lanes[1]);
+	pb = _mm256_permutevar8x32_epi32(b, lanes[1]);
+	pc = _mm256_permutevar8x32_epi32(c, lanes[1]);
+	_mm256_storeu_si256((__m256i *)&dst[8], _mm256_blend_epi32(_mm256_blend_epi32(pa, pb, 0x24), pc, 0x49));
+	pa = _mm256_permutevar8x32_epi32(a, lanes[2]);
+	pb = _mm256_permutevar8x32_epi32(b, lanes[2]);
+	pc = _mm256_permutevar8x32_epi32(c, lanes[2]);
+	_mm256_storeu_si256((__m256i *)&dst[16], _mm256_blend_epi32(_mm256_blend_epi32(pa, pb, 0x49), pc, 0x92));
+}
+
+__attribute__((target("avx2")))
+void scale3x_row_avx2(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+					  uint32_t *out0, uint32_t *out1, uint32_t *out2, const uint32_t width){
+	uint32_t x = 0;
+	for(; x + 8 <= width; x += 8){
+		const __m256i A = _mm256_loadu_si256((const __m256i *)(&above[x] - 1));
+		const __m256i B = _mm256_loadu_si256((const __m256i *)&above[x]);
+		const __m256i C = _mm256_loadu_si256((const __m256i *)(&above[x] + 1));
+		const __m256i D = _mm256_loadu_si256((const __m256i *)(&row[x] - 1));
+		const __m256i E = _mm256_loadu_si256((const __m256i *)&row[x]);
+		const __m256i F = _mm256_loadu_si256((const __m256i *)(&row[x] + 1));
+		const __m256i G = _mm256_loadu_si256((const __m256i *)(&below[x] - 1));
+		const __m256i H = _mm256_loadu_si256((const __m256i *)&below[x]);
+		const __m256i I = _mm256_loadu_si256((const __m256i *)(&below[x] + 1));
+		const __m256i ones = _mm256_set1_epi32(-1);
+
+		const __m256i edge = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi32(B, H), _mm256_cmpeq_epi32(D, F)), ones);
+		const __m256i DB = _mm256_and_si256(edge, _mm256_cmpeq_epi32(D, B));
+		const __m256i BF = _mm256_and_si256(edge, _mm256_cmpeq_epi32(B, F));
+		const __m256i DH = _mm256_and_si256(edge, _mm256_cmpeq_epi32(D, H));
+		const __m256i HF = _mm256_and_si256(edge, _mm256_cmpeq_epi32(H, F));
+		const __m256i nEA = _mm256_andnot_si256(_mm256_cmpeq_epi32(E, A), ones);
+		const __m256i nEC = _mm256_andnot_si256(_mm256_cmpeq_epi32(E, C), ones);
+		const __m256i nEG = _mm256_andnot_si256(_mm256_cmpeq_epi32(E, G), ones);
+		const __m256i nEI = _mm256_andnot_si256(_mm256_cmpeq_epi32(E, I), ones);
+
+		#define SELECT(m, a) _mm256_blendv_epi8(E, a, m)
+		store_interleaved3_avx2(&out0[x*3], SELECT(DB, D),
+								SELECT(_mm256_or_si256(_mm256_and_si256(DB, nEC), _mm256_and_si256(BF, nEA)), B),
+								SELECT(BF, F));
+		store_interleaved3_avx2(&out1[x*3], SELECT(_mm256_or_si256(_mm256_and_si256(DB, nEG), _mm256_and_si256(DH, nEA)), D),
+								E,
+								SELECT(_mm256_or_si256(_mm256_and_si256(BF, nEI), _mm256_and_si256(HF, nEC)), F));
+		store_interleaved3_avx2(&out2[x*3], SELECT(DH, D),
+								SELECT(_mm256_or_si256(_mm256_and_si256(DH, nEI), _mm256_and_si256(HF, nEG)), H),
+								SELECT(HF, F));
+		#undef SELECT
+	}
+	if(x < width)
+		scale3x_row_scalar(&above[x], &row[x], &below[x], &out0[x*3], &out1[x*3], &out2[x*3], width - x);
+}
+
+__attribute__((target("sse2")))
+void crt_row_sse2(uint32_t *row, const uint32_t width, const bool scanline, const bool mask){
+	// 4 pixels per step, so the mask phase advances by one column every step
+	const __m128i keep[3] = {
+		_mm_setr_epi32(0xFF0000FF, 0x00FF00FF, 0x0000FFFF, 0xFF0000FF),
+		_mm_setr_epi32(0x00FF00FF, 0x0000FFFF, 0xFF0000FF, 0x00FF00FF),
+		_mm_setr_epi32(0x0000FFFF, 0xFF0000FF, 0x00FF00FF, 0x0000FFFF),
+	};
+	const __m128i half_mask = _mm_set1_epi32(0x7F7F7F7F);
+	const __m128i alpha = _mm_set1_epi32(0xFF);
+	uint32_t x = 0;
+	for(uint32_t phase = 0; x + 4 <= width; x += 4, phase = (phase + 1) % 3){
+		__m128i pixel = _mm_loadu_si128((const __m128i *)&row[x]);
+		if(mask){
+			const __m128i half = _mm_and_si128(_mm_srli_epi32(pixel, 1), half_mask);
+			pixel = _mm_or_si128(_mm_and_si128(keep[phase], pixel), _mm_andnot_si128(keep[phase], half));
+		}
+		if(scanline){
+			const __m128i half = _mm_and_si128(_mm_srli_epi32(pixel, 1), half_mask);
+			pixel = _mm_or_si128(_mm_andnot_si128(alpha, half), _mm_and_si128(alpha, pixel));
+		}
+		_mm_storeu_si128((__m128i *)&row[x], pixel);
+	}
+	for(; x < width; x++)
+		row[x] = crt_pixel(row[x], x, scanline, mask);
+}
+
+__attribute__((target("avx2")))
+void crt_row_avx2(uint32_t *row, const uint32_t width, const bool scanline, const bool mask){
+	// 8 pixels per step, so the mask phase advances by two columns every step
+	const __m256i keep[3] = {
+		_mm256_setr_epi32(0xFF0000FF, 0x00FF00FF, 0x0000FFFF, 0xFF0000FF, 0x00FF00FF, 0x0000FFFF, 0xFF0000FF, 0x00FF00FF),
+		_mm256_setr_epi32(0x00FF00FF, 0x0000FFFF, 0xFF0000FF, 0x00FF00FF, 0x0000FFFF, 0xFF0000FF, 0x00FF00FF, 0x0000FFFF),
+		_mm256_setr_epi32(0x0000FFFF, 0xFF0000FF, 0x00FF00FF, 0x0000FFFF, 0xFF0000FF, 0x00FF00FF, 0x0000FFFF, 0xFF0000FF),
+	};
+	const __m256i half_mask = _mm256_set1_epi32(0x7F7F7F7F);
+	const __m256i alpha = _mm256_set1_epi32(0xFF);
+	uint32_t x = 0;
+	for(uint32_t phase = 0; x + 8 <= width; x += 8, phase = (phase + 2) % 3){
+		__m256i pixel = _mm256_loadu_si256((const __m256i *)&row[x]);
+		if(mask){
+			const __m256i half = _mm256_and_si256(_mm256_srli_epi32(pixel, 1), half_mask);
+			pixel = _mm256_or_si256(_mm256_and_si256(keep[phase], pixel), _mm256_andnot_si256(keep[phase], half));
+		}
+		if(scanline){
+			const __m256i half = _mm256_and_si256(_mm256_srli_epi32(pixel, 1), half_mask);
+			pixel = _mm256_or_si256(_mm256_andnot_si256(alpha, half), _mm256_and_si256(alpha, pixel));
+		}
+		_mm256_storeu_si256((__m256i *)&row[x], pixel);
+	}
+	for(; x < width; x++)
+		row[x] = crt_pixel(row[x], x, scanline, mask);
+}
+#endif
+
+scale2x_row_t scale2x_row = scale2x_row_scalar;
+scale3x_row_t scale3x_row = scale3x_row_scalar;
+crt_row_t crt_row = crt_row_scalar;
+
+// Pick the widest vector unit the CPU has
+void init_upscaler(void){
+#ifdef UPSCALE_X86
+	if(SDL_HasSSE2()){
+		scale2x_row = scale2x_row_sse2;
+		scale3x_row = scale3x_row_sse2;
+		crt_row = crt_row_sse2;
+	}
+	if(SDL_HasAVX2()){
+		scale2x_row = scale2x_row_avx2;
+		scale3x_row = scale3x_row_avx2;
+		crt_row = crt_row_avx2;
+	}
+#endif
+}
+
+// Copy a frame into a buffer with a one pixel border replicating the edges
+void pad_frame(const uint32_t *src, const uint32_t width, const uint32_t height, uint32_t *padded){
+	const uint32_t stride = width + 2;
+	for(uint32_t y = 0; y < height; y++){
+		uint32_t *dst = &padded[(y + 1) * stride];
+		memcpy(&dst[1], &src[y * width], width * sizeof(uint32_t));
+		dst[0] = dst[1];
+		dst[width + 1] = dst[width];
+	}
+	memcpy(&padded[0], &padded[stride], stride * sizeof(uint32_t));
+	memcpy(&padded[(height + 1) * stride], &padded[height * stride], stride * sizeof(uint32_t));
+}
+
+// Scale a frame into pixels (pitch in pixels), returns the scale factor used
+uint32_t upscale_frame(const uint32_t *src, const uint32_t width, const uint32_t height,
+					   const upscale_t filter, const crt_t crt, uint32_t *pixels, const uint32_t pitch){
+	static uint32_t padded[(UPSCALE_MAX_WIDTH / 2 + 2) * (UPSCALE_MAX_HEIGHT / 2 + 2)];
+	static uint32_t scaled2x[UPSCALE_MAX_WIDTH / 2 * UPSCALE_MAX_HEIGHT / 2];
+	uint32_t factor = 1;
+
+	switch(filter){
+		case UPSCALE_SCALE2X:
+		case UPSCALE_SCALE4X: {
+			uint32_t *out = filter == UPSCALE_SCALE2X ? pixels : scaled2x;
+			const uint32_t out_pitch = filter == UPSCALE_SCALE2X ? pitch : width * 2;
+			pad_frame(src, width, height, padded);
+			for(uint32_t y = 0; y < height; y++){
+				const uint32_t *row = &padded[(y + 1) * (width + 2) + 1];
+				scale2x_row(row - (width + 2), row, row + (width + 2),
+							&out[y * 2 * out_pitch], &out[(y * 2 + 1) * out_pitch], width);
+			}
+			factor = 2;
+			if(filter == UPSCALE_SCALE2X) break;
+
+			pad_frame(scaled2x, width * 2, height * 2, padded);
+			for(uint32_t y = 0; y < height * 2; y++){
+				const uint32_t *row = &padded[(y + 1) * (width * 2 + 2) + 1];
+				scale2x_row(row - (width * 2 + 2), row, row + (width * 2 + 2),
+							&pixels[y * 2 * pitch], &pixels[(y * 2 + 1) * pitch], width * 2);
+			}
+			factor = 4;
+			break;
+		}
+		case UPSCALE_SCALE3X:
+			pad_frame(src, width, height, padded);
+			for(uint32_t y = 0; y < height; y++){
+				const uint32_t *row = &padded[(y + 1) * (width + 2) + 1];
+				scale3x_row(row - (width + 2), row, row + (width + 2), &pixels[y * 3 * pitch],
+							&pixels[(y * 3 + 1) * pitch], &pixels[(y * 3 + 2) * pitch], width);
+			}
+			factor = 3;
+			break;
+		default:
+			// Plain pixels, blown up only when scanlines need rows to darken
+			factor = crt == CRT_OFF ? 1 : UPSCALE_MAX_FACTOR;
+			for(uint32_t y = 0; y < height; y++){
+				uint32_t *out = &pixels[y * factor * pitch];
+				for(uint32_t x = 0; x < width; x++)
+					for(uint32_t i = 0; i < factor; i++)
+						out[x * factor + i] = src[y * width + x];
+				for(uint32_t i = 1; i < factor; i++)
+					memcpy(&out[i * pitch], out, width * factor * sizeof(uint32_t));
+			}
+			break;
+	}
+
+	if(crt != CRT_OFF && factor > 1){
+		for(uint32_t y = 0; y < height * factor; y++)
+			crt_row(&pixels[y * pitch], width * factor, y % factor == factor - 1, crt == CRT_MASK);
+	}
+	return factor;
+}
+
 // Initialize SDL
 bool init_sdl(sdl_t *sdl, config_t *config){
 	if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) != 0){
@@ -106,20 +599,46 @@ bool init_sdl(sdl_t *sdl, config_t *config){
 		"CHIP8 Emulator", 
 		SDL_WINDOWPOS_CENTERED, 
 		SDL_WINDOWPOS_CENTERED, 
-		config->window_width * config->scale_factor, 
-		config->window_height * config->scale_factor, 
-		0);
+		64 * config->scale_factor, 
+		32 * config->scale_factor, 
+		SDL_WINDOW_RESIZABLE);
 	if(!sdl->window){
 		SDL_Log("Could not create window %s\n", SDL_GetError());
 		return false;
 	}
 
-	sdl->renderer = SDL_CreateRenderer(sdl->window, -1, SDL_RENDERER_ACCELERATED);
+	// Vsync needs to know the refresh rate to keep the CHIP8 speed, fall back to hybrid pacing
+	SDL_DisplayMode mode;
+	const int display = SDL_GetWindowDisplayIndex(sdl->window);
+	sdl->refresh_rate = (display >= 0 && SDL_GetCurrentDisplayMode(display, &mode) == 0) ? mode.refresh_rate : 0;
+	if(config->pacing == PACING_VSYNC && sdl->refresh_rate == 0){
+		SDL_Log("Could not detect the display refresh rate, using hybrid pacing\n");
+		config->pacing = PACING_HYBRID;
+	}
+
+	const uint32_t renderer_flags = SDL_RENDERER_ACCELERATED | (config->pacing == PACING_VSYNC ? SDL_RENDERER_PRESENTVSYNC : 0);
+	sdl->renderer = SDL_CreateRenderer(sdl->window, -1, renderer_flags);
 	if(!sdl->renderer){
 		SDL_Log("Could not create renderer %s\n", SDL_GetError());
 		return false;
 	}
 
+	// The driver may ignore the vsync request, presenting would not wait and nothing would pace the frames
+	SDL_RendererInfo renderer_info;
+	if(config->pacing == PACING_VSYNC &&
+	   (SDL_GetRendererInfo(sdl->renderer, &renderer_info) != 0 || !(renderer_info.flags & SDL_RENDERER_PRESENTVSYNC))){
+		SDL_Log("Vsync is not available, using hybrid pacing\n");
+		config->pacing = PACING_HYBRID;
+	}
+
+	sdl->texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+									 UPSCALE_MAX_WIDTH, UPSCALE_MAX_HEIGHT);
+	if(!sdl->texture){
+		SDL_Log("Could not create screen texture %s\n", SDL_GetError());
+		return false;
+	}
+	init_upscaler();
+
 	sdl->want = (SDL_AudioSpec){
 		.freq = 44100,
 		.format = AUDIO_S16LSB,
@@ -142,161 +661,1652 @@ bool init_sdl(sdl_t *sdl, config_t *config){
 	return true; // Succes
 }
 
-bool set_config_from_args(config_t *config, const int argc, char **argv){
-	*config = (config_t){
-		.window_width = 64,
-		.window_height = 32,
-		.super_mode = false,
-		.fg_color = 0xFFFFFFFF,
-		.bg_color = 0x00000000,
-		.scale_factor = 20,
-		.pixel_outlines = false,
-		.insts_per_second = 700,
-		.square_wave_freq = 440,
-		.audio_sample_rate = 44100,
-		.volume = 3000,
-		.color_lerp_rate = 0.7,
-	};
-	for(int i = 1; i < argc; i++){
-		(void)argv[i];
-		if (strncmp(argv[i], "--scale-factor", strlen("--scale-factor")) == 0){
-			i++;
-			config->scale_factor = (uint32_t)strtol(argv[i], NULL, 10);
+// Octo assembler
+// Assembles Octo sources (.8o) straight into CHIP8 memory : labels, :const, :alias, :macro, :calc,
+// :byte, :org, :next, :unpack, structured if/else, loop/while and the XO-CHIP extensions.
+// Tokens are separated by whitespace, # starts a comment. Forward references to labels are
+// patched once the whole source has been read.
+#define OCTO_NAME_MAX 64
+#define OCTO_MAX_SYMBOLS 1024
+#define OCTO_MAX_FIXUPS 2048
+#define OCTO_MAX_NESTING 64
+
+typedef struct {
+	char *text;
+	uint32_t line;
+} octo_token_t;
+
+typedef enum {
+	OCTO_LABEL,
+	OCTO_CONST,
+	OCTO_ALIAS,
+	OCTO_MACRO,
+} octo_symbol_kind_t;
+
+typedef struct {
+	char name[OCTO_NAME_MAX];
+	octo_symbol_kind_t kind;
+	int32_t value;          // Address, constant or register
+	bool defined;           // Labels can be used before they are defined
+	uint32_t body;          // Macros : first token of the body in macro_tokens
+	uint32_t body_length;
+	uint32_t arg_count;     // The argument names are the first tokens of the body
+} octo_symbol_t;
+
+typedef enum {
+	OCTO_FIXUP_NNN,         // Low 12 bits of an instruction
+	OCTO_FIXUP_LONG,        // 16 bit address after F000
+	OCTO_FIXUP_UNPACK_HI,   // Low nibble of v0 := for :unpack
+	OCTO_FIXUP_UNPACK_LO,   // v1 := for :unpack
+} octo_fixup_kind_t;
+
+typedef struct {
+	uint16_t addr;
+	octo_fixup_kind_t kind;
+	uint32_t symbol;
+	uint32_t line;
+} octo_fixup_t;
+
+typedef struct {
+	bool is_loop;
+	uint16_t addr;          // Loop start, or the jump to patch for if/else
+	uint32_t first_while;   // Index of the first pending while jump in while_jumps
+} octo_block_t;
+
+typedef struct {
+	uint8_t ram[65536];     // Indexed by address, only 0x200 up is used
+	uint32_t here;
+	uint32_t end;           // One past the highest byte written
+	bool main_reserved;     // A jump to main sits at 0x200
+
+	octo_token_t *tokens;
+	uint32_t token_count;
+	uint32_t pos;
+	octo_token_t *macro_tokens;
+	uint32_t macro_token_count;
+
+	octo_symbol_t symbols[OCTO_MAX_SYMBOLS];
+	uint32_t symbol_count;
+	octo_fixup_t fixups[OCTO_MAX_FIXUPS];
+	uint32_t fixup_count;
+	octo_block_t blocks[OCTO_MAX_NESTING];
+	uint32_t block_count;
+	uint16_t while_jumps[OCTO_MAX_FIXUPS];
+	uint32_t while_count;
+
+	char error[256];
+	uint32_t error_line;
+	char *source;           // Source text the tokens point into, owned by the caller
+} octo_t;
+
+bool octo_fail(octo_t *octo, const char *fmt, const char *detail){
+	if(octo->error[0] == '\0'){
+		snprintf(octo->error, sizeof octo->error, fmt, detail);
+		octo->error_line = octo->pos > 0 && octo->pos <= octo->token_count ? octo->tokens[octo->pos - 1].line : 0;
+	}
+	return false;
+}
+
+// Split the source in place, every token ends up NUL terminated inside text
+bool octo_tokenize(octo_t *octo, char *text){
+	uint32_t capacity = 1024;
+	uint32_t line = 1;
+	octo->tokens = malloc(capacity * sizeof(octo_token_t));
+	if(!octo->tokens) return octo_fail(octo, "Out of memory%s", "");
+
+	while(*text){
+		if(*text == '\n') line++;
+		if(isspace((unsigned char)*text)){
+			*text++ = '\0';
+			continue;
+		}
+		if(*text == '#'){
+			while(*text && *text != '\n') *text++ = '\0';
+			continue;
 		}
+		if(octo->token_count == capacity){
+			capacity *= 2;
+			octo_token_t *tokens = realloc(octo->tokens, capacity * sizeof(octo_token_t));
+			if(!tokens) return octo_fail(octo, "Out of memory%s", "");
+			octo->tokens = tokens;
+		}
+		octo->tokens[octo->token_count++] = (octo_token_t){text, line};
+		while(*text && !isspace((unsigned char)*text)) text++;
 	}
 	return true;
 }
 
-bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]){
-	const uint32_t entry_point = 0x200;
-	const uint8_t font[] = {
-		0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
-		0x29, 0x60, 0x20, 0x20, 0x70,  // 1
-		0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
-		0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
-		0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
-		0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
-		0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
-		0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
-		0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
-		0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
-		0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
-		0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
-		0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
-		0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
-		0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
-		0xF0, 0x80, 0xF0, 0x80, 0x80,  // F
-	};
-	memset(chip8, 0, sizeof(chip8_t));
-	memcpy(&chip8->ram[0], font, sizeof(font));
+bool octo_at_end(const octo_t *octo){
+	return octo->pos >= octo->token_count;
+}
 
-	FILE *rom = fopen(rom_name, "rb");
-	if(!rom){
-		SDL_Log("Rom file %s is invalid or does not exist\n", rom_name);
-		return false;
-	}
+const char *octo_peek(const octo_t *octo){
+	return octo_at_end(octo) ? "" : octo->tokens[octo->pos].text;
+}
 
-	fseek(rom, 0, SEEK_END);
-	const size_t rom_size = ftell(rom);
-	const size_t max_size = sizeof chip8->ram - entry_point;
-	rewind(rom);
-	if(rom_size > max_size){
-		SDL_Log("Rom file %s is too big ! Rom size: %lu, Max size: %lu\n", 
-				rom_name, (long unsigned)rom_size, (long unsigned)max_size);
-		return false;
+const char *octo_next(octo_t *octo){
+	if(octo_at_end(octo)){
+		octo_fail(octo, "Unexpected end of file%s", "");
+		return "";
 	}
+	return octo->tokens[octo->pos++].text;
+}
 
-	if(fread(&chip8->ram[entry_point], rom_size, 1, rom) != 1){
-		SDL_Log("Could not read the rom file %s into CHIP8 memory\n", rom_name);
-		return false;
+bool octo_expect(octo_t *octo, const char *expected){
+	if(strcmp(octo_next(octo), expected) != 0) return octo_fail(octo, "Expected '%s'", expected);
+	return true;
+}
+
+octo_symbol_t *octo_find(octo_t *octo, const char *name){
+	for(uint32_t i = 0; i < octo->symbol_count; i++)
+		if(strcmp(octo->symbols[i].name, name) == 0) return &octo->symbols[i];
+	return NULL;
+}
+
+octo_symbol_t *octo_add(octo_t *octo, const char *name, const octo_symbol_kind_t kind){
+	octo_symbol_t *symbol = octo_find(octo, name);
+	if(symbol){
+		if(symbol->kind == OCTO_LABEL && symbol->defined && kind == OCTO_LABEL){
+			octo_fail(octo, "Label '%s' is defined twice", name);
+			return NULL;
+		}
+		symbol->kind = kind;
+		return symbol;
+	}
+	if(octo->symbol_count == OCTO_MAX_SYMBOLS || strlen(name) >= OCTO_NAME_MAX){
+		octo_fail(octo, "Too many symbols or name too long : %s", name);
+		return NULL;
 	}
-	fclose(rom);
+	symbol = &octo->symbols[octo->symbol_count++];
+	memset(symbol, 0, sizeof(octo_symbol_t));
+	strcpy(symbol->name, name);
+	symbol->kind = kind;
+	return symbol;
+}
 
-	chip8->state = RUNNING;
-	chip8->PC = entry_point;
-	chip8->rom_name = rom_name;
-	chip8->stack_ptr = &chip8->stack[0];
-	memset(&chip8->pixel_color[0], config.bg_color, sizeof chip8->pixel_color);
+bool octo_parse_number(const char *text, int32_t *value){
+	char *end;
+	const bool negative = text[0] == '-';
+	const char *digits = negative ? text + 1 : text;
+	long result;
+
+	if(digits[0] == '0' && (digits[1] == 'b' || digits[1] == 'B'))
+		result = strtol(digits + 2, &end, 2);
+	else
+		result = strtol(digits, &end, digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X') ? 16 : 10);
+	if(*digits == '\0' || *end != '\0' || !isxdigit((unsigned char)digits[0])) return false;
 
+	*value = negative ? -result : result;
 	return true;
 }
 
-void final_cleanup(const sdl_t sdl){
-	SDL_DestroyRenderer(sdl.renderer);
-	SDL_DestroyWindow(sdl.window);
-	SDL_CloseAudioDevice(sdl.dev);
-	SDL_Quit(); // Shutdown SDL subsystems
+// Key names are the Octo keyboard layout : 1234 / QWER / ASDF / ZXCV
+bool octo_builtin_constant(const char *name, int32_t *value){
+	static const char keys[] = "X123QWEASDZC4RFV";
+	if(strncmp(name, "OCTO_KEY_", 9) == 0 && name[9] && !name[10]){
+		const char *key = strchr(keys, name[9]);
+		if(key){
+			*value = key - keys;
+			return true;
+		}
+	}
+	return false;
 }
 
-void clear_screen(const sdl_t sdl, const config_t config){
-	const uint32_t r = (config.bg_color >> 24) & 0xFF;
-	const uint32_t g = (config.bg_color >> 16) & 0xFF;
-	const uint32_t b = (config.bg_color >> 8) & 0xFF;
-	const uint32_t a = (config.bg_color >> 0) & 0xFF;
-
-	SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-	SDL_RenderClear(sdl.renderer);
+int octo_register(octo_t *octo, const char *text){
+	if((text[0] == 'v' || text[0] == 'V') && isxdigit((unsigned char)text[1]) && text[2] == '\0')
+		return isdigit((unsigned char)text[1]) ? text[1] - '0' : tolower((unsigned char)text[1]) - 'a' + 10;
+	const octo_symbol_t *symbol = octo_find(octo, text);
+	if(symbol && symbol->kind == OCTO_ALIAS) return symbol->value;
+	return -1;
 }
 
-void update_screen(const sdl_t sdl,const config_t config, chip8_t *chip8){
-	SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
+bool octo_is_register(octo_t *octo){
+	return !octo_at_end(octo) && octo_register(octo, octo_peek(octo)) >= 0;
+}
 
-	const uint32_t bg_r = (config.bg_color >> 24) & 0xFF;
-	const uint32_t bg_g = (config.bg_color >> 16) & 0xFF;
-	const uint32_t bg_b = (config.bg_color >> 8) & 0xFF;
-	const uint32_t bg_a = (config.bg_color >> 0) & 0xFF;
+bool octo_next_register(octo_t *octo, uint8_t *reg){
+	const char *text = octo_next(octo);
+	const int value = octo_register(octo, text);
+	if(value < 0) return octo_fail(octo, "Expected a register, got '%s'", text);
+	*reg = value;
+	return true;
+}
 
-	for(uint32_t i = 0; i < sizeof chip8->display; i++){
-		rect.x = (i % config.window_width) * config.scale_factor;
-		rect.y = (i / config.window_width) * config.scale_factor;
+// Value known right now : number, constant, defined label or HERE
+bool octo_value(octo_t *octo, const char *text, int32_t *value){
+	if(octo_parse_number(text, value) || octo_builtin_constant(text, value)) return true;
+	if(strcmp(text, "HERE") == 0){
+		*value = octo->here;
+		return true;
+	}
+	const octo_symbol_t *symbol = octo_find(octo, text);
+	if(symbol && (symbol->kind == OCTO_CONST || (symbol->kind == OCTO_LABEL && symbol->defined))){
+		*value = symbol->value;
+		return true;
+	}
+	return false;
+}
 
-		if(chip8->display[i]){
-			if(chip8->pixel_color[i] != config.fg_color){
-				chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], config.fg_color, config.color_lerp_rate);
-			}
-			const uint32_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-			const uint32_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-			const uint32_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
-			const uint32_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
+bool octo_next_byte(octo_t *octo, uint8_t *byte){
+	const char *text = octo_next(octo);
+	int32_t value;
+	if(!octo_value(octo, text, &value)) return octo_fail(octo, "Undefined value '%s'", text);
+	if(value < -128 || value > 255) return octo_fail(octo, "Value '%s' does not fit in a byte", text);
+	*byte = value;
+	return true;
+}
 
-			SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-			SDL_RenderFillRect(sdl.renderer, &rect);
+bool octo_emit_byte(octo_t *octo, const uint8_t byte){
+	if(octo->here >= sizeof octo->ram) return octo_fail(octo, "Program too big%s", "");
+	octo->ram[octo->here++] = byte;
+	if(octo->here > octo->end) octo->end = octo->here;
+	return true;
+}
 
-			if(config.pixel_outlines){
-				SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-				SDL_RenderDrawRect(sdl.renderer, &rect);
-			}
+bool octo_emit(octo_t *octo, const uint16_t opcode){
+	return octo_emit_byte(octo, opcode >> 8) && octo_emit_byte(octo, opcode & 0xFF);
+}
 
-		} else{
-			if(chip8->pixel_color[i] != config.bg_color){
-				chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], config.bg_color, config.color_lerp_rate);
-			}
-			const uint32_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-			const uint32_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-			const uint32_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
-			const uint32_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
+// Address operand, labels not defined yet are patched at the end
+bool octo_emit_address(octo_t *octo, const uint16_t opcode, const octo_fixup_kind_t kind){
+	const char *text = octo_next(octo);
+	int32_t value;
 
-			SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-			SDL_RenderFillRect(sdl.renderer, &rect);
+	if(!octo_value(octo, text, &value)){
+		octo_symbol_t *symbol = octo_find(octo, text);
+		if(!symbol){
+			if(octo_register(octo, text) >= 0) return octo_fail(octo, "Expected an address, got register '%s'", text);
+			symbol = octo_add(octo, text, OCTO_LABEL);
+			if(!symbol) return false;
 		}
+		if(symbol->kind != OCTO_LABEL) return octo_fail(octo, "Expected an address, got '%s'", text);
+		if(octo->fixup_count == OCTO_MAX_FIXUPS) return octo_fail(octo, "Too many forward references%s", "");
+		octo->fixups[octo->fixup_count++] = (octo_fixup_t){
+			.addr = octo->here, .kind = kind, .symbol = symbol - octo->symbols, .line = octo->tokens[octo->pos - 1].line,
+		};
+		value = 0;
 	}
-	SDL_RenderPresent(sdl.renderer);
+
+	if(kind == OCTO_FIXUP_LONG) return octo_emit(octo, opcode) && octo_emit(octo, value);
+	if(value < 0 || value > 0xFFF) return octo_fail(octo, "Address '%s' out of range", text);
+	return octo_emit(octo, opcode | value);
 }
 
-void update_timers(const sdl_t sdl, chip8_t *chip8){
-	if(chip8->delay_timer > 0)
-		chip8->delay_timer--;
-	if(chip8->sound_timer > 0){
-		chip8->sound_timer--;
-		SDL_PauseAudioDevice(sdl.dev, 0);
-	} else{
-		SDL_PauseAudioDevice(sdl.dev, 1);
+// Emit the instructions skipping the next one when the condition is false (or true when negated)
+bool octo_conditional(octo_t *octo, const bool negated){
+	uint8_t reg;
+	if(!octo_next_register(octo, &reg)) return false;
+	const char *op = octo_next(octo);
+
+	static const char *ops[][2] = {
+		{"==", "!="}, {"!=", "=="}, {"<", ">="}, {">", "<="}, {"<=", ">"}, {">=", "<"}, {"key", "-key"}, {"-key", "key"},
+	};
+	uint32_t i;
+	for(i = 0; i < sizeof ops / sizeof ops[0]; i++)
+		if(strcmp(op, ops[i][0]) == 0) break;
+	if(i == sizeof ops / sizeof ops[0]) return octo_fail(octo, "Unknown comparison '%s'", op);
+	if(negated) op = ops[i][1];
+
+	if(strcmp(op, "key") == 0) return octo_emit(octo, 0xE0A1 | reg << 8);
+	if(strcmp(op, "-key") == 0) return octo_emit(octo, 0xE09E | reg << 8);
+
+	const bool is_register = octo_is_register(octo);
+	uint8_t other = 0, byte = 0;
+	if(is_register ? !octo_next_register(octo, &other) : !octo_next_byte(octo, &byte)) return false;
+
+	if(strcmp(op, "==") == 0) return octo_emit(octo, (is_register ? 0x9000 | other << 4 : 0x4000 | byte) | reg << 8);
+	if(strcmp(op, "!=") == 0) return octo_emit(octo, (is_register ? 0x5000 | other << 4 : 0x3000 | byte) | reg << 8);
+
+	// Magnitude comparisons go through vf : vf := other, then subtract and test the borrow
+	if(!octo_emit(octo, is_register ? 0x8F00 | other << 4 : 0x6F00 | byte)) return false;
+	if(strcmp(op, "<") == 0) return octo_emit(octo, 0x8F07 | reg << 4) && octo_emit(octo, 0x4F00);
+	if(strcmp(op, ">") == 0) return octo_emit(octo, 0x8F05 | reg << 4) && octo_emit(octo, 0x4F00);
+	if(strcmp(op, "<=") == 0) return octo_emit(octo, 0x8F05 | reg << 4) && octo_emit(octo, 0x3F00);
+	return octo_emit(octo, 0x8F07 | reg << 4) && octo_emit(octo, 0x3F00);
+}
+
+// Expressions are evaluated right to left without precedence, like Octo does
+bool octo_calc(octo_t *octo, int32_t *result){
+	int32_t value;
+	const char *text = octo_next(octo);
+
+	if(strcmp(text, "(") == 0){
+		if(!octo_calc(octo, &value) || !octo_expect(octo, ")")) return false;
+	} else if(strcmp(text, "-") == 0 || strcmp(text, "~") == 0 || strcmp(text, "!") == 0){
+		if(!octo_calc(octo, &value)) return false;
+		*result = text[0] == '-' ? -value : text[0] == '~' ? ~value : !value;
+		return true;
+	} else if(!octo_value(octo, text, &value)){
+		return octo_fail(octo, "Undefined value '%s' in expression", text);
 	}
+
+	const char *op = octo_peek(octo);
+	static const char *binary[] = {"+", "-", "*", "/", "%", "&", "|", "^", "<<", ">>", "<", ">", "==", "!=", "<=", ">="};
+	uint32_t i;
+	for(i = 0; i < sizeof binary / sizeof binary[0]; i++)
+		if(strcmp(op, binary[i]) == 0) break;
+	if(i == sizeof binary / sizeof binary[0]){
+		*result = value;
+		return true;
+	}
+	octo->pos++;
+
+	int32_t rhs;
+	if(!octo_calc(octo, &rhs)) return false;
+	if((i == 3 || i == 4) && rhs == 0) return octo_fail(octo, "Division by zero%s", "");
+	switch(i){
+		case 0: *result = value + rhs; break;
+		case 1: *result = value - rhs; break;
+		case 2: *result = value * rhs; break;
+		case 3: *result = value / rhs; break;
+		case 4: *result = value % rhs; break;
+		case 5: *result = value & rhs; break;
+		case 6: *result = value | rhs; break;
+		case 7: *result = value ^ rhs; break;
+		case 8: *result = value << rhs; break;
+		case 9: *result = value >> rhs; break;
+		case 10: *result = value < rhs; break;
+		case 11: *result = value > rhs; break;
+		case 12: *result = value == rhs; break;
+		case 13: *result = value != rhs; break;
+		case 14: *result = value <= rhs; break;
+		default: *result = value >= rhs; break;
+	}
+	return true;
 }
 
-// Keypad:	CHIP8	 AZERTY
-//			123C	 1234
-//			456D	 AZER
+// Copy the macro body in place of the invocation, arguments replaced by the tokens given
+bool octo_expand_macro(octo_t *octo, const octo_symbol_t *macro){
+	const uint32_t args_start = octo->pos;
+	if(args_start + macro->arg_count > octo->token_count) return octo_fail(octo, "Missing arguments for macro '%s'", macro->name);
+
+	const uint32_t body_length = macro->body_length - macro->arg_count;
+	const uint32_t count = octo->token_count - macro->arg_count + body_length;
+	octo_token_t *tokens = malloc((count + 1) * sizeof(octo_token_t));
+	if(!tokens) return octo_fail(octo, "Out of memory%s", "");
+
+	const octo_token_t *names = &octo->macro_tokens[macro->body];
+	const uint32_t line = octo->tokens[args_start - 1].line;
+	memcpy(tokens, octo->tokens, args_start * sizeof(octo_token_t));
+	for(uint32_t i = 0; i < body_length; i++){
+		octo_token_t token = names[macro->arg_count + i];
+		for(uint32_t arg = 0; arg < macro->arg_count; arg++)
+			if(strcmp(token.text, names[arg].text) == 0) token = octo->tokens[args_start + arg];
+		token.line = line;
+		tokens[args_start + i] = token;
+	}
+	memcpy(&tokens[args_start + body_length], &octo->tokens[args_start + macro->arg_count],
+		   (octo->token_count - args_start - macro->arg_count) * sizeof(octo_token_t));
+
+	free(octo->tokens);
+	octo->tokens = tokens;
+	octo->token_count = count;
+	return true;
+}
+
+// Everything starting with ':'
+bool octo_directive(octo_t *octo, const char *directive){
+	if(strcmp(directive, ":") == 0){
+		const char *name = octo_next(octo);
+		// Nothing emitted before main, no need for the jump to it
+		if(strcmp(name, "main") == 0 && octo->main_reserved && octo->here == 0x202){
+			octo->main_reserved = false;
+			octo->here = octo->end = 0x200;
+		}
+		octo_symbol_t *label = octo_add(octo, name, OCTO_LABEL);
+		if(!label) return false;
+		label->value = octo->here;
+		label->defined = true;
+		return true;
+	}
+	if(strcmp(directive, ":next") == 0){
+		octo_symbol_t *label = octo_add(octo, octo_next(octo), OCTO_LABEL);
+		if(!label) return false;
+		label->value = octo->here + 1;
+		label->defined = true;
+		return true;
+	}
+	if(strcmp(directive, ":const") == 0){
+		const char *name = octo_next(octo);
+		int32_t value;
+		const char *text = octo_next(octo);
+		if(!octo_value(octo, text, &value)) return octo_fail(octo, "Undefined value '%s'", text);
+		octo_symbol_t *constant = octo_add(octo, name, OCTO_CONST);
+		if(!constant) return false;
+		constant->value = value;
+		return true;
+	}
+	if(strcmp(directive, ":calc") == 0){
+		const char *name = octo_next(octo);
+		int32_t value;
+		if(!octo_expect(octo, "{") || !octo_calc(octo, &value) || !octo_expect(octo, "}")) return false;
+		octo_symbol_t *constant = octo_add(octo, name, OCTO_CONST);
+		if(!constant) return false;
+		constant->value = value;
+		return true;
+	}
+	if(strcmp(directive, ":alias") == 0){
+		const char *name = octo_next(octo);
+		uint8_t reg;
+		if(!octo_next_register(octo, &reg)) return false;
+		octo_symbol_t *alias = octo_add(octo, name, OCTO_ALIAS);
+		if(!alias) return false;
+		alias->value = reg;
+		return true;
+	}
+	if(strcmp(directive, ":byte") == 0){
+		int32_t value;
+		if(strcmp(octo_peek(octo), "{") == 0){
+			octo->pos++;
+			if(!octo_calc(octo, &value) || !octo_expect(octo, "}")) return false;
+			return octo_emit_byte(octo, value);
+		}
+		uint8_t byte;
+		return octo_next_byte(octo, &byte) && octo_emit_byte(octo, byte);
+	}
+	if(strcmp(directive, ":org") == 0){
+		int32_t value;
+		const char *text = octo_next(octo);
+		if(!octo_value(octo, text, &value) || value < 0 || value >= (int32_t)sizeof octo->ram)
+			return octo_fail(octo, "Invalid address '%s'", text);
+		octo->here = value;
+		return true;
+	}
+	if(strcmp(directive, ":unpack") == 0){
+		// v0 := high nibble | (N << 4), v1 := low byte of the label
+		uint8_t nibble;
+		if(!octo_next_byte(octo, &nibble)) return false;
+		const uint32_t label_pos = octo->pos;
+		if(!octo_emit_address(octo, 0x6000 | (nibble & 0xF) << 4, OCTO_FIXUP_UNPACK_HI)) return false;
+		octo->pos = label_pos;
+		return octo_emit_address(octo, 0x6100, OCTO_FIXUP_UNPACK_LO);
+	}
+	if(strcmp(directive, ":macro") == 0){
+		octo_symbol_t *macro = octo_add(octo, octo_next(octo), OCTO_MACRO);
+		if(!macro) return false;
+		macro->arg_count = 0;
+		while(!octo_at_end(octo) && strcmp(octo_peek(octo), "{") != 0){
+			octo->pos++;
+			macro->arg_count++;
+		}
+		const uint32_t args = octo->pos - macro->arg_count;
+		if(!octo_expect(octo, "{")) return false;
+
+		// Store argument names then body, braces inside the body have to balance
+		const uint32_t body = octo->pos;
+		uint32_t depth = 1;
+		while(depth){
+			const char *text = octo_next(octo);
+			if(octo->error[0]) return false;
+			if(strcmp(text, "{") == 0) depth++;
+			if(strcmp(text, "}") == 0) depth--;
+		}
+		const uint32_t length = octo->pos - 1 - body;
+		octo_token_t *tokens = realloc(octo->macro_tokens, (octo->macro_token_count + macro->arg_count + length + 1) * sizeof(octo_token_t));
+		if(!tokens) return octo_fail(octo, "Out of memory%s", "");
+		octo->macro_tokens = tokens;
+		macro->body = octo->macro_token_count;
+		memcpy(&tokens[octo->macro_token_count], &octo->tokens[args], macro->arg_count * sizeof(octo_token_t));
+		memcpy(&tokens[octo->macro_token_count + macro->arg_count], &octo->tokens[body], length * sizeof(octo_token_t));
+		macro->body_length = macro->arg_count + length;
+		octo->macro_token_count += macro->body_length;
+		return true;
+	}
+	if(strcmp(directive, ":breakpoint") == 0 || strcmp(directive, ":monitor") == 0){
+		// Debugger hints for Octo, ignored
+		octo_next(octo);
+		if(strcmp(directive, ":monitor") == 0) octo_next(octo);
+		return true;
+	}
+	return octo_fail(octo, "Unknown directive '%s'", directive);
+}
+
+bool octo_statement(octo_t *octo);
+
+// vX := ..., vX op= ...
+bool octo_register_statement(octo_t *octo, const uint8_t reg){
+	const char *op = octo_next(octo);
+
+	if(strcmp(op, ":=") == 0){
+		const char *source = octo_peek(octo);
+		if(strcmp(source, "delay") == 0){ octo->pos++; return octo_emit(octo, 0xF007 | reg << 8); }
+		if(strcmp(source, "key") == 0){ octo->pos++; return octo_emit(octo, 0xF00A | reg << 8); }
+		if(strcmp(source, "random") == 0){
+			uint8_t mask;
+			octo->pos++;
+			return octo_next_byte(octo, &mask) && octo_emit(octo, 0xC000 | reg << 8 | mask);
+		}
+		if(octo_is_register(octo)){
+			uint8_t other;
+			return octo_next_register(octo, &other) && octo_emit(octo, 0x8000 | reg << 8 | other << 4);
+		}
+		uint8_t byte;
+		return octo_next_byte(octo, &byte) && octo_emit(octo, 0x6000 | reg << 8 | byte);
+	}
+
+	static const struct { const char *op; uint8_t n; } alu[] = {
+		{"|=", 1}, {"&=", 2}, {"^=", 3}, {"+=", 4}, {"-=", 5}, {">>=", 6}, {"=-", 7}, {"<<=", 0xE},
+	};
+	for(uint32_t i = 0; i < sizeof alu / sizeof alu[0]; i++){
+		if(strcmp(op, alu[i].op) != 0) continue;
+		if(octo_is_register(octo)){
+			uint8_t other;
+			return octo_next_register(octo, &other) && octo_emit(octo, 0x8000 | reg << 8 | other << 4 | alu[i].n);
+		}
+		// Immediate forms only exist for += and -= (as an addition of the negated value)
+		uint8_t byte;
+		if(alu[i].n != 4 && alu[i].n != 5) return octo_fail(octo, "'%s' needs a register operand", op);
+		if(!octo_next_byte(octo, &byte)) return false;
+		return octo_emit(octo, 0x7000 | reg << 8 | (uint8_t)(alu[i].n == 4 ? byte : -byte));
+	}
+	return octo_fail(octo, "Unknown register operation '%s'", op);
+}
+
+bool octo_statement(octo_t *octo){
+	const char *token = octo_next(octo);
+	if(octo->error[0]) return false;
+
+	if(token[0] == ':' ) return octo_directive(octo, token);
+
+	const int reg = octo_register(octo, token);
+	if(reg >= 0) return octo_register_statement(octo, reg);
+
+	// Instructions without operand
+	static const struct { const char *name; uint16_t opcode; } simple[] = {
+		{"clear", 0x00E0}, {"return", 0x00EE}, {";", 0x00EE}, {"scroll-right", 0x00FB}, {"scroll-left", 0x00FC},
+		{"exit", 0x00FD}, {"lores", 0x00FE}, {"hires", 0x00FF}, {"audio", 0xF002},
+	};
+	for(uint32_t i = 0; i < sizeof simple / sizeof simple[0]; i++)
+		if(strcmp(token, simple[i].name) == 0) return octo_emit(octo, simple[i].opcode);
+
+	// Instructions with one register operand
+	static const struct { const char *name; uint16_t opcode; } unary[] = {
+		{"bcd", 0xF033}, {"save", 0xF055}, {"load", 0xF065}, {"saveflags", 0xF075}, {"loadflags", 0xF085},
+	};
+	for(uint32_t i = 0; i < sizeof unary / sizeof unary[0]; i++){
+		if(strcmp(token, unary[i].name) != 0) continue;
+		uint8_t x, y;
+		if(!octo_next_register(octo, &x)) return false;
+		// XO-CHIP save/load of a register range
+		if(i <= 2 && i > 0 && strcmp(octo_peek(octo), "-") == 0){
+			octo->pos++;
+			if(!octo_next_register(octo, &y)) return false;
+			return octo_emit(octo, (i == 1 ? 0x5002 : 0x5003) | x << 8 | y << 4);
+		}
+		return octo_emit(octo, unary[i].opcode | x << 8);
+	}
+
+	if(strcmp(token, "scroll-down") == 0 || strcmp(token, "scroll-up") == 0){
+		uint8_t n;
+		if(!octo_next_byte(octo, &n)) return false;
+		return octo_emit(octo, (token[7] == 'd' ? 0x00C0 : 0x00D0) | (n & 0xF));
+	}
+	if(strcmp(token, "plane") == 0){
+		uint8_t n;
+		return octo_next_byte(octo, &n) && octo_emit(octo, 0xF001 | (n & 0xF) << 8);
+	}
+	if(strcmp(token, "sprite") == 0){
+		uint8_t x, y, n;
+		if(!octo_next_register(octo, &x) || !octo_next_register(octo, &y) || !octo_next_byte(octo, &n)) return false;
+		return octo_emit(octo, 0xD000 | x << 8 | y << 4 | (n & 0xF));
+	}
+	if(strcmp(token, "jump") == 0) return octo_emit_address(octo, 0x1000, OCTO_FIXUP_NNN);
+	if(strcmp(token, "jump0") == 0) return octo_emit_address(octo, 0xB000, OCTO_FIXUP_NNN);
+	if(strcmp(token, "native") == 0) return octo_emit_address(octo, 0x0000, OCTO_FIXUP_NNN);
+	if(strcmp(token, "delay") == 0 || strcmp(token, "buzzer") == 0 || strcmp(token, "pitch") == 0){
+		uint8_t x;
+		if(!octo_expect(octo, ":=") || !octo_next_register(octo, &x)) return false;
+		return octo_emit(octo, (token[0] == 'd' ? 0xF015 : token[0] == 'b' ? 0xF018 : 0xF03A) | x << 8);
+	}
+	if(strcmp(token, "i") == 0){
+		const char *op = octo_next(octo);
+		uint8_t x;
+		if(strcmp(op, "+=") == 0) return octo_next_register(octo, &x) && octo_emit(octo, 0xF01E | x << 8);
+		if(strcmp(op, ":=") != 0) return octo_fail(octo, "Unknown i operation '%s'", op);
+		const char *source = octo_peek(octo);
+		if(strcmp(source, "hex") == 0 || strcmp(source, "bighex") == 0){
+			octo->pos++;
+			return octo_next_register(octo, &x) && octo_emit(octo, (source[0] == 'h' ? 0xF029 : 0xF030) | x << 8);
+		}
+		if(strcmp(source, "long") == 0){
+			octo->pos++;
+			return octo_emit_address(octo, 0xF000, OCTO_FIXUP_LONG);
+		}
+		return octo_emit_address(octo, 0xA000, OCTO_FIXUP_NNN);
+	}
+
+	// Control flow
+	if(strcmp(token, "if") == 0){
+		const uint32_t cond_pos = octo->pos;
+		// Find out whether this is "then" or "begin" before emitting the comparison
+		while(!octo_at_end(octo) && strcmp(octo_peek(octo), "then") != 0 && strcmp(octo_peek(octo), "begin") != 0)
+			octo->pos++;
+		const bool block = strcmp(octo_next(octo), "begin") == 0;
+		const uint32_t body_pos = octo->pos;
+		octo->pos = cond_pos;
+		if(!octo_conditional(octo, block)) return false;
+		octo->pos = body_pos;
+		if(!block) return true;
+
+		if(octo->block_count == OCTO_MAX_NESTING) return octo_fail(octo, "Blocks nested too deep%s", "");
+		octo->blocks[octo->block_count++] = (octo_block_t){.is_loop = false, .addr = octo->here};
+		return octo_emit(octo, 0x1000);
+	}
+	if(strcmp(token, "else") == 0 || strcmp(token, "end") == 0){
+		if(octo->block_count == 0 || octo->blocks[octo->block_count - 1].is_loop)
+			return octo_fail(octo, "'%s' without 'if ... begin'", token);
+		octo_block_t *block = &octo->blocks[octo->block_count - 1];
+		const uint16_t patch = block->addr;
+		if(token[0] == 'e' && token[1] == 'l'){
+			block->addr = octo->here;
+			if(!octo_emit(octo, 0x1000)) return false;
+		} else {
+			octo->block_count--;
+		}
+		octo->ram[patch] = 0x10 | octo->here >> 8;
+		octo->ram[patch + 1] = octo->here & 0xFF;
+		return true;
+	}
+	if(strcmp(token, "loop") == 0){
+		if(octo->block_count == OCTO_MAX_NESTING) return octo_fail(octo, "Blocks nested too deep%s", "");
+		octo->blocks[octo->block_count++] = (octo_block_t){.is_loop = true, .addr = octo->here, .first_while = octo->while_count};
+		return true;
+	}
+	if(strcmp(token, "while") == 0){
+		if(octo->block_count == 0 || !octo->blocks[octo->block_count - 1].is_loop) return octo_fail(octo, "'while' outside of a loop%s", "");
+		if(octo->while_count == OCTO_MAX_FIXUPS) return octo_fail(octo, "Too many while%s", "");
+		if(!octo_conditional(octo, true)) return false;
+		octo->while_jumps[octo->while_count++] = octo->here;
+		return octo_emit(octo, 0x1000);
+	}
+	if(strcmp(token, "again") == 0){
+		if(octo->block_count == 0 || !octo->blocks[octo->block_count - 1].is_loop) return octo_fail(octo, "'again' without 'loop'%s", "");
+		const octo_block_t block = octo->blocks[--octo->block_count];
+		if(!octo_emit(octo, 0x1000 | block.addr)) return false;
+		for(uint32_t i = block.first_while; i < octo->while_count; i++){
+			octo->ram[octo->while_jumps[i]] = 0x10 | octo->here >> 8;
+			octo->ram[octo->while_jumps[i] + 1] = octo->here & 0xFF;
+		}
+		octo->while_count = block.first_while;
+		return true;
+	}
+
+	// Raw data bytes
+	int32_t value;
+	if(octo_value(octo, token, &value) && !(octo_find(octo, token) && octo_find(octo, token)->kind == OCTO_LABEL)){
+		if(value < -128 || value > 255) return octo_fail(octo, "Value '%s' does not fit in a byte", token);
+		return octo_emit_byte(octo, value);
+	}
+
+	// Macro invocation or call to a label
+	const octo_symbol_t *symbol = octo_find(octo, token);
+	if(symbol && symbol->kind == OCTO_MACRO) return octo_expand_macro(octo, symbol);
+	octo->pos--;
+	return octo_emit_address(octo, 0x2000, OCTO_FIXUP_NNN);
+}
+
+// Assemble source into octo->ram, the program spans 0x200 to octo->end
+bool octo_assemble(octo_t *octo, char *source){
+	memset(octo, 0, sizeof(octo_t));
+	octo->here = octo->end = 0x200;
+
+	if(!octo_tokenize(octo, source)) return false;
+
+	// Reserve the jump to main, dropped if main comes first
+	octo->main_reserved = true;
+	octo_emit(octo, 0x1000);
+
+	while(!octo_at_end(octo))
+		if(!octo_statement(octo)) return false;
+
+	if(octo->block_count) return octo_fail(octo, "Missing 'end' or 'again'%s", "");
+
+	const octo_symbol_t *main_label = octo_find(octo, "main");
+	if(!main_label || !main_label->defined) return octo_fail(octo, "The program has no main label%s", "");
+	if(octo->main_reserved){
+		octo->ram[0x200] = 0x10 | main_label->value >> 8;
+		octo->ram[0x201] = main_label->value & 0xFF;
+	}
+
+	for(uint32_t i = 0; i < octo->fixup_count; i++){
+		const octo_fixup_t *fixup = &octo->fixups[i];
+		const octo_symbol_t *label = &octo->symbols[fixup->symbol];
+		if(!label->defined){
+			snprintf(octo->error, sizeof octo->error, "Undefined label '%s'", label->name);
+			octo->error_line = fixup->line;
+			return false;
+		}
+		uint8_t *bytes = &octo->ram[fixup->addr];
+		switch(fixup->kind){
+			case OCTO_FIXUP_NNN:
+				if(label->value > 0xFFF){
+					snprintf(octo->error, sizeof octo->error, "Label '%s' is out of reach", label->name);
+					octo->error_line = fixup->line;
+					return false;
+				}
+				bytes[0] |= label->value >> 8;
+				bytes[1] = label->value & 0xFF;
+				break;
+			case OCTO_FIXUP_LONG:
+				bytes[2] = label->value >> 8;
+				bytes[3] = label->value & 0xFF;
+				break;
+			case OCTO_FIXUP_UNPACK_HI:
+				bytes[1] |= (label->value >> 8) & 0xF;
+				break;
+			case OCTO_FIXUP_UNPACK_LO:
+				bytes[1] = label->value & 0xFF;
+				break;
+		}
+	}
+	return true;
+}
+
+void octo_free(octo_t *octo){
+	free(octo->tokens);
+	free(octo->macro_tokens);
+	octo->tokens = NULL;
+	octo->macro_tokens = NULL;
+}
+
+// ROM loading
+// The ROM file is mapped once at startup and stays mapped, resets copy it from the mapping.
+// Octo sources (.8o) are assembled in memory instead.
+// Everything learned about a ROM is kept in a small text cache keyed by the ROM hash, in the
+// per-user folder SDL picks for the application whatever the working directory.
+#define ROM_CACHE_FILE "rom_cache.txt"
+#define ROM_CACHE_HEADER "# chip8 rom cache v2"
+
+typedef struct {
+	uint64_t hash;
+	quirks_t quirks;
+	uint32_t insts_per_second;
+	uint8_t code_map[4096/8];  // Bit set for every address reachable as an instruction
+} rom_metadata_t;
+
+typedef struct rom {
+	const char *name;
+	const uint8_t *data;
+	size_t size;
+	rom_metadata_t metadata;
+	octo_t *octo;        // Assembler state of an Octo source, NULL for binary ROMs
+	uint8_t *assembled;  // Assembled program, data points into it
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} rom_t;
+
+// 64 bit FNV-1a
+uint64_t hash_rom(const uint8_t *data, const size_t size){
+	uint64_t hash = 0xCBF29CE484222325;
+	for(size_t i = 0; i < size; i++){
+		hash ^= data[i];
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+bool map_rom(rom_t *rom, const char *rom_name){
+	memset(rom, 0, sizeof(rom_t));
+	rom->name = rom_name;
+
+#ifdef _WIN32
+	rom->file = CreateFileA(rom_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(rom->file == INVALID_HANDLE_VALUE){
+		SDL_Log("Rom file %s is invalid or does not exist\n", rom_name);
+		return false;
+	}
+	rom->size = GetFileSize(rom->file, NULL);
+	if(rom->size == 0) return true;
+
+	rom->mapping = CreateFileMappingA(rom->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	rom->data = rom->mapping ? MapViewOfFile(rom->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+	const int fd = open(rom_name, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+		SDL_Log("Rom file %s is invalid or does not exist\n", rom_name);
+		if(fd >= 0) close(fd);
+		return false;
+	}
+	rom->size = st.st_size;
+	if(rom->size == 0){
+		close(fd);
+		return true;
+	}
+
+	void *data = mmap(NULL, rom->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	rom->data = data == MAP_FAILED ? NULL : data;
+#endif
+	if(!rom->data){
+		SDL_Log("Could not map the rom file %s\n", rom_name);
+		return false;
+	}
+	return true;
+}
+
+// Assemble an Octo source into a ROM image owned by rom
+bool assemble_rom(rom_t *rom, octo_t **octo_out){
+	FILE *file = fopen(rom->name, "rb");
+	if(!file){
+		SDL_Log("Source file %s is invalid or does not exist\n", rom->name);
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	const size_t size = ftell(file);
+	rewind(file);
+
+	// Tokens point into the source, it lives as long as the assembler state
+	char *source = malloc(size + 1);
+	octo_t *octo = malloc(sizeof(octo_t));
+	if(!source || !octo || fread(source, 1, size, file) != size){
+		SDL_Log("Could not read the source file %s\n", rom->name);
+		fclose(file);
+		free(source);
+		free(octo);
+		return false;
+	}
+	fclose(file);
+	source[size] = '\0';
+
+	if(!octo_assemble(octo, source)){
+		SDL_Log("%s:%u: %s\n", rom->name, octo->error_line, octo->error);
+		octo_free(octo);
+		free(octo);
+		free(source);
+		return false;
+	}
+
+	uint8_t *data = malloc(octo->end - 0x200 + 1);
+	if(!data){
+		octo_free(octo);
+		free(octo);
+		free(source);
+		return false;
+	}
+	memcpy(data, &octo->ram[0x200], octo->end - 0x200);
+
+	free(rom->assembled);
+	if(rom->octo){
+		free(rom->octo->source);
+		octo_free(rom->octo);
+		free(rom->octo);
+	}
+	octo->source = source;
+	rom->assembled = data;
+	rom->data = data;
+	rom->size = octo->end - 0x200;
+	rom->octo = octo;
+	if(octo_out) *octo_out = octo;
+	return true;
+}
+
+void unmap_rom(rom_t *rom){
+	if(rom->octo){
+		free(rom->octo->source);
+		octo_free(rom->octo);
+		free(rom->octo);
+		free(rom->assembled);
+		rom->octo = NULL;
+		rom->data = NULL;
+		return;
+	}
+#ifdef _WIN32
+	if(rom->data) UnmapViewOfFile(rom->data);
+	if(rom->mapping) CloseHandle(rom->mapping);
+	if(rom->file && rom->file != INVALID_HANDLE_VALUE) CloseHandle(rom->file);
+#else
+	if(rom->data) munmap((void *)rom->data, rom->size);
+#endif
+	rom->data = NULL;
+}
+
+// Follow every path from the entry point to find which bytes are code, and guess the
+// platform from the opcodes actually reachable (sprite data could look like anything).
+// The resolution is not guessed, programs start in 64x32 and switch with 00FF when they need to.
+void analyze_rom(rom_metadata_t *metadata, const uint8_t ram[4096]){
+	uint16_t worklist[4096];
+	uint32_t count = 0;
+	bool schip = false, xochip = false;
+
+	memset(metadata->code_map, 0, sizeof metadata->code_map);
+	worklist[count++] = 0x200;
+
+	while(count){
+		uint16_t addr = worklist[--count];
+
+		for(;;){
+			if(addr < 0x200 || addr > 4096 - 2) break;
+			if(metadata->code_map[addr / 8] & (1 << (addr % 8))) break;
+			metadata->code_map[addr / 8] |= 1 << (addr % 8);
+
+			instruction_t inst;
+			decode_instruction(&inst, (ram[addr] << 8) | ram[addr+1]);
+			const uint8_t op = inst.opcode >> 12;
+			const uint16_t next = addr + 2;
+			// XO-CHIP F000 NNNN is 4 bytes long, skips have to jump over all of it
+			const uint16_t skip = next + ((next <= 4096 - 2 && ram[next] == 0xF0 && ram[next+1] == 0x00) ? 4 : 2);
+			bool stop = false;
+
+			if(inst.opcode == 0x00EE || inst.opcode == 0x00FD){
+				stop = true;
+			} else if(op == 0x1){
+				if(count < 4096) worklist[count++] = inst.NNN;
+				stop = true;
+			} else if(op == 0x2){
+				if(count < 4096) worklist[count++] = inst.NNN;
+			} else if(op == 0x3 || op == 0x4 || (op == 0x5 && inst.N == 0) || op == 0x9 ||
+					  (op == 0xE && (inst.NN == 0x9E || inst.NN == 0xA1))){
+				if(count < 4096) worklist[count++] = skip;
+			} else if(op == 0xB){
+				stop = true;  // Computed jump, targets are unknown
+			}
+
+			if(inst.N2 == 0x0C0 && op == 0 && inst.X == 0) schip = true;
+			if(inst.opcode >= 0x00FB && inst.opcode <= 0x00FF) schip = true;
+			if(op == 0xD && inst.N == 0) schip = true;
+			if(op == 0xF && (inst.NN == 0x30 || inst.NN == 0x75 || inst.NN == 0x85)) schip = true;
+			if(op == 0x5 && (inst.N == 2 || inst.N == 3)) xochip = true;
+			if(op == 0x0 && inst.X == 0 && inst.N2 == 0x0D0) xochip = true;
+			if(inst.opcode == 0xF000 || inst.opcode == 0xF002 || (op == 0xF && inst.NN == 0x01)) xochip = true;
+			if(op == 0xF && inst.NN == 0x3A) xochip = true;
+
+			if(stop) break;
+			addr = inst.opcode == 0xF000 ? addr + 4 : next;
+		}
+	}
+
+	metadata->quirks = xochip ? QUIRKS_XOCHIP : schip ? QUIRKS_SCHIP : QUIRKS_DEFAULT;
+	metadata->insts_per_second = 700;
+}
+
+const char *rom_cache_path(void){
+	static char path[1024];
+	if(!path[0]){
+		char *folder = SDL_GetPrefPath("TheodoreDev", "chip8");
+		if(!folder){
+			SDL_Log("Could not find a folder for the rom cache %s\n", SDL_GetError());
+			return NULL;
+		}
+		snprintf(path, sizeof path, "%s%s", folder, ROM_CACHE_FILE);
+		SDL_free(folder);
+	}
+	return path;
+}
+
+// One cache line : hash, quirk profile, instructions per second and the code map in hex. Anything
+// else is rejected, lines written by older versions included.
+bool parse_rom_cache_line(const char *line, rom_metadata_t *metadata){
+	unsigned long long hash;
+	char quirks[16];
+	char code_map[sizeof metadata->code_map * 2 + 1];
+	if(sscanf(line, "%16llx %15s %u %1024s", &hash, quirks, &metadata->insts_per_second, code_map) != 4) return false;
+	if(metadata->insts_per_second == 0 || strlen(code_map) != sizeof code_map - 1) return false;
+
+	for(metadata->quirks = 0; metadata->quirks < QUIRKS_COUNT; metadata->quirks++)
+		if(strcmp(quirks, quirk_profiles[metadata->quirks].name) == 0) break;
+	if(metadata->quirks == QUIRKS_COUNT) return false;
+
+	for(size_t i = 0; i < sizeof metadata->code_map; i++){
+		unsigned byte;
+		if(sscanf(&code_map[i * 2], "%2x", &byte) != 1) return false;
+		metadata->code_map[i] = byte;
+	}
+	metadata->hash = hash;
+	return true;
+}
+
+bool load_rom_metadata(rom_metadata_t *metadata, const uint64_t hash){
+	const char *path = rom_cache_path();
+	FILE *cache = path ? fopen(path, "r") : NULL;
+	if(!cache) return false;
+
+	char line[1536];
+	bool found = false;
+	while(!found && fgets(line, sizeof line, cache)){
+		static rom_metadata_t entry;
+		if(!parse_rom_cache_line(line, &entry) || entry.hash != hash) continue;
+		*metadata = entry;
+		found = true;
+	}
+	fclose(cache);
+	return found;
+}
+
+// Write the cache again with the entry for this ROM replaced or appended, and every other valid
+// line kept. The new cache is written next to it and renamed over it, readers never see a partial file.
+bool rewrite_rom_cache(const char *path, const rom_metadata_t *metadata){
+	char entry[1536];
+	int length = snprintf(entry, sizeof entry, "%016llx %s %u ", (unsigned long long)metadata->hash,
+						  quirk_profiles[metadata->quirks].name, metadata->insts_per_second);
+	for(size_t i = 0; i < sizeof metadata->code_map; i++)
+		length += snprintf(&entry[length], sizeof entry - length, "%02x", metadata->code_map[i]);
+	snprintf(&entry[length], sizeof entry - length, "\n");
+
+	char *content = NULL;
+	size_t content_size = 0;
+	FILE *cache = fopen(path, "rb");
+	if(cache){
+		fseek(cache, 0, SEEK_END);
+		content_size = ftell(cache);
+		rewind(cache);
+		content = malloc(content_size + 1);
+		if(!content || fread(content, 1, content_size, cache) != content_size) content_size = 0;
+		if(content) content[content_size] = '\0';
+		fclose(cache);
+	}
+
+	char temp_path[1100];
+#ifdef _WIN32
+	snprintf(temp_path, sizeof temp_path, "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+#else
+	snprintf(temp_path, sizeof temp_path, "%s.%ld.tmp", path, (long)getpid());
+#endif
+	cache = fopen(temp_path, "wb");
+	if(!cache){
+		SDL_Log("Could not write the rom cache %s\n", temp_path);
+		free(content);
+		return false;
+	}
+	fprintf(cache, "%s\n", ROM_CACHE_HEADER);
+
+	for(char *line = content_size ? strtok(content, "\n") : NULL; line; line = strtok(NULL, "\n")){
+		static rom_metadata_t other;
+		if(!parse_rom_cache_line(line, &other) || other.hash == metadata->hash) continue;
+		fprintf(cache, "%s\n", line);
+	}
+	fputs(entry, cache);
+	free(content);
+
+	const bool written = !ferror(cache);
+	if(fclose(cache) != 0 || !written){
+		SDL_Log("Could not write the rom cache %s\n", temp_path);
+		remove(temp_path);
+		return false;
+	}
+#ifdef _WIN32
+	const bool replaced = MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+	const bool replaced = rename(temp_path, path) == 0;
+#endif
+	if(!replaced){
+		SDL_Log("Could not replace the rom cache %s\n", path);
+		remove(temp_path);
+		return false;
+	}
+	return true;
+}
+
+// Instances starting together take turns through a lock on a file next to the cache, so each one
+// reads the cache the previous one wrote and no entry is lost
+bool save_rom_metadata(const rom_metadata_t *metadata){
+	const char *path = rom_cache_path();
+	if(!path) return false;
+
+	char lock_path[1100];
+	snprintf(lock_path, sizeof lock_path, "%s.lock", path);
+#ifdef _WIN32
+	HANDLE lock = CreateFileA(lock_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, 0, NULL);
+	OVERLAPPED region = {0};
+	if(lock == INVALID_HANDLE_VALUE || !LockFileEx(lock, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &region)){
+		SDL_Log("Could not lock the rom cache %s\n", lock_path);
+		if(lock != INVALID_HANDLE_VALUE) CloseHandle(lock);
+		return false;
+	}
+#else
+	const int lock = open(lock_path, O_RDWR | O_CREAT, 0644);
+	struct flock region = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+	int locked = lock < 0 ? -1 : fcntl(lock, F_SETLKW, &region);
+	while(locked != 0 && lock >= 0 && errno == EINTR) locked = fcntl(lock, F_SETLKW, &region);
+	if(locked != 0){
+		SDL_Log("Could not lock the rom cache %s\n", lock_path);
+		if(lock >= 0) close(lock);
+		return false;
+	}
+#endif
+
+	const bool saved = rewrite_rom_cache(path, metadata);
+
+	// Closing the lock file releases the lock
+#ifdef _WIN32
+	CloseHandle(lock);
+#else
+	close(lock);
+#endif
+	return saved;
+}
+
+// Map the ROM and fetch its metadata, analyzing it only the first time it is seen. The analysis is
+// added to the cache when update_cache is set.
+bool load_rom(rom_t *rom, const char *rom_name, const bool update_cache){
+	const size_t length = strlen(rom_name);
+	if(length > 3 && strcmp(&rom_name[length - 3], ".8o") == 0){
+		memset(rom, 0, sizeof(rom_t));
+		rom->name = rom_name;
+		if(!assemble_rom(rom, NULL)) return false;
+	} else if(!map_rom(rom, rom_name)){
+		return false;
+	}
+
+	const uint64_t hash = hash_rom(rom->data, rom->size);
+	if(load_rom_metadata(&rom->metadata, hash)) return true;
+
+	static uint8_t ram[4096];
+	memset(ram, 0, sizeof ram);
+	memcpy(&ram[0x200], rom->data, rom->size < sizeof ram - 0x200 ? rom->size : sizeof ram - 0x200);
+	analyze_rom(&rom->metadata, ram);
+	rom->metadata.hash = hash;
+	if(update_cache) save_rom_metadata(&rom->metadata);
+	return true;
+}
+
+bool set_config_from_args(config_t *config, const rom_metadata_t *metadata, const int argc, char **argv){
+	*config = (config_t){
+		.fg_color = 0xFFFFFFFF,
+		.bg_color = 0x00000000,
+		.scale_factor = 20,
+		.pixel_outlines = false,
+		.insts_per_second = metadata->insts_per_second,
+		.square_wave_freq = 440,
+		.audio_sample_rate = 44100,
+		.volume = 3000,
+		.color_lerp_rate = 0.7,
+		.trace_path = NULL,
+		.record_path = NULL,
+		.quirks = metadata->quirks,
+		.pacing = PACING_VSYNC,
+		.show_overlay = false,
+		.debug = false,
+		.remember = false,
+		.upscale = UPSCALE_NONE,
+		.crt = CRT_OFF,
+	};
+	for(int i = 1; i < argc; i++){
+		(void)argv[i];
+		if (strncmp(argv[i], "--scale-factor", strlen("--scale-factor")) == 0){
+			i++;
+			config->scale_factor = (uint32_t)strtol(argv[i], NULL, 10);
+		} else if (strncmp(argv[i], "--ips", strlen("--ips")) == 0 && i + 1 < argc){
+			i++;
+			config->insts_per_second = (uint32_t)strtol(argv[i], NULL, 10);
+		} else if (strncmp(argv[i], "--trace", strlen("--trace")) == 0 && i + 1 < argc){
+			i++;
+			config->trace_path = argv[i];
+		} else if (strncmp(argv[i], "--record", strlen("--record")) == 0 && i + 1 < argc){
+			i++;
+			config->record_path = argv[i];
+		} else if (strncmp(argv[i], "--debug", strlen("--debug")) == 0){
+			config->debug = true;
+		} else if (strncmp(argv[i], "--remember", strlen("--remember")) == 0){
+			config->remember = true;
+		} else if (strncmp(argv[i], "--quirks", strlen("--quirks")) == 0 && i + 1 < argc){
+			i++;
+			for(config->quirks = 0; config->quirks < QUIRKS_COUNT; config->quirks++)
+				if(strcmp(argv[i], quirk_profiles[config->quirks].name) == 0) break;
+			if(config->quirks == QUIRKS_COUNT){
+				SDL_Log("Unknown quirk profile %s (default, chip8, schip, xochip)\n", argv[i]);
+				return false;
+			}
+		} else if (strncmp(argv[i], "--pacing", strlen("--pacing")) == 0 && i + 1 < argc){
+			i++;
+			if(strcmp(argv[i], "vsync") == 0){
+				config->pacing = PACING_VSYNC;
+			} else if(strcmp(argv[i], "hybrid") == 0){
+				config->pacing = PACING_HYBRID;
+			} else {
+				SDL_Log("Unknown pacing mode %s (vsync, hybrid)\n", argv[i]);
+				return false;
+			}
+		} else if (strncmp(argv[i], "--upscale", strlen("--upscale")) == 0 && i + 1 < argc){
+			i++;
+			const char *names[UPSCALE_COUNT] = {"none", "scale2x", "scale3x", "scale4x"};
+			for(config->upscale = 0; config->upscale < UPSCALE_COUNT; config->upscale++)
+				if(strcmp(argv[i], names[config->upscale]) == 0) break;
+			if(config->upscale == UPSCALE_COUNT){
+				SDL_Log("Unknown upscale filter %s (none, scale2x, scale3x, scale4x)\n", argv[i]);
+				return false;
+			}
+		} else if (strncmp(argv[i], "--crt", strlen("--crt")) == 0 && i + 1 < argc){
+			i++;
+			const char *names[CRT_COUNT] = {"off", "scanlines", "mask"};
+			for(config->crt = 0; config->crt < CRT_COUNT; config->crt++)
+				if(strcmp(argv[i], names[config->crt]) == 0) break;
+			if(config->crt == CRT_COUNT){
+				SDL_Log("Unknown crt effect %s (off, scanlines, mask)\n", argv[i]);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool init_chip8(chip8_t *chip8, const config_t config, const rom_t *rom){
+	const uint32_t entry_point = 0x200;
+	const uint8_t font[] = {
+		0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
+		0x20, 0x60, 0x20, 0x20, 0x70,  // 1
+		0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
+		0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
+		0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
+		0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
+		0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
+		0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
+		0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
+		0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
+		0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
+		0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
+		0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
+		0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
+		0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
+		0xF0, 0x80, 0xF0, 0x80, 0x80,  // F
+	};
+	// SUPER-CHIP 8x10 digits, right after the small font where FX30 points
+	const uint8_t big_font[] = {
+		0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C,  // 0
+		0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C,  // 1
+		0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF,  // 2
+		0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C,  // 3
+		0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06,  // 4
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C,  // 5
+		0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C,  // 6
+		0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60,  // 7
+		0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C,  // 8
+		0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C,  // 9
+	};
+	memset(chip8, 0, sizeof(chip8_t));
+	memcpy(&chip8->ram[0], font, sizeof(font));
+	memcpy(&chip8->ram[sizeof(font)], big_font, sizeof(big_font));
+
+	const size_t max_size = sizeof chip8->ram - entry_point;
+	if(rom->size > max_size){
+		SDL_Log("Rom file %s is too big ! Rom size: %lu, Max size: %lu\n", 
+				rom->name, (long unsigned)rom->size, (long unsigned)max_size);
+		return false;
+	}
+	memcpy(&chip8->ram[entry_point], rom->data, rom->size);
+
+	chip8->state = RUNNING;
+	chip8->PC = entry_point;
+	chip8->rom = rom;
+	chip8->stack_ptr = &chip8->stack[0];
+	chip8->random = rand();  // Headless modes set their own seed
+	chip8->width = 64;       // Every program starts in low resolution, 00FF switches
+	chip8->height = 32;
+	memset(&chip8->pixel_color[0], config.bg_color, sizeof chip8->pixel_color);
+
+	return true;
+}
+
+void final_cleanup(const sdl_t sdl){
+	SDL_DestroyTexture(sdl.texture);
+	SDL_DestroyRenderer(sdl.renderer);
+	SDL_DestroyWindow(sdl.window);
+	SDL_CloseAudioDevice(sdl.dev);
+	SDL_Quit(); // Shutdown SDL subsystems
+}
+
+void clear_screen(const sdl_t sdl, const config_t config){
+	const uint32_t r = (config.bg_color >> 24) & 0xFF;
+	const uint32_t g = (config.bg_color >> 16) & 0xFF;
+	const uint32_t b = (config.bg_color >> 8) & 0xFF;
+	const uint32_t a = (config.bg_color >> 0) & 0xFF;
+
+	SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+	SDL_RenderClear(sdl.renderer);
+}
+
+void update_screen(const sdl_t sdl,const config_t config, chip8_t *chip8){
+	const uint32_t pixel_count = chip8->width * chip8->height;
+
+	// Fade every pixel toward its on/off color
+	for(uint32_t i = 0; i < pixel_count; i++){
+		const uint32_t target = chip8->display[i] ? config.fg_color : config.bg_color;
+		if(chip8->pixel_color[i] != target){
+			chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], target, config.color_lerp_rate);
+		}
+	}
+
+	if(config.pixel_outlines){
+		// The window is sized for 64x32, high resolution pixels are half as big
+		const int size = config.scale_factor * 64 / chip8->width ? config.scale_factor * 64 / chip8->width : 1;
+		SDL_Rect rect = {.x = 0, .y = 0, .w = size, .h = size};
+
+		const uint32_t bg_r = (config.bg_color >> 24) & 0xFF;
+		const uint32_t bg_g = (config.bg_color >> 16) & 0xFF;
+		const uint32_t bg_b = (config.bg_color >> 8) & 0xFF;
+		const uint32_t bg_a = (config.bg_color >> 0) & 0xFF;
+
+		for(uint32_t i = 0; i < pixel_count; i++){
+			rect.x = (i % chip8->width) * size;
+			rect.y = (i / chip8->width) * size;
+
+			const uint32_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
+			const uint32_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
+			const uint32_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
+			const uint32_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
+
+			SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+			SDL_RenderFillRect(sdl.renderer, &rect);
+
+			if(chip8->display[i]){
+				SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
+				SDL_RenderDrawRect(sdl.renderer, &rect);
+			}
+		}
+		return;
+	}
+
+	// Upscale into the streaming texture and let SDL stretch it over the window
+	void *pixels;
+	int pitch;
+	if(SDL_LockTexture(sdl.texture, NULL, &pixels, &pitch) != 0){
+		SDL_Log("Could not lock screen texture %s\n", SDL_GetError());
+		return;
+	}
+	const uint32_t factor = upscale_frame(chip8->pixel_color, chip8->width, chip8->height,
+										  config.upscale, config.crt, pixels, pitch / sizeof(uint32_t));
+	SDL_UnlockTexture(sdl.texture);
+
+	const SDL_Rect src = {0, 0, chip8->width * factor, chip8->height * factor};
+	SDL_RenderClear(sdl.renderer);
+	SDL_RenderCopy(sdl.renderer, sdl.texture, &src, NULL);
+}
+
+void update_timers(const sdl_t sdl, chip8_t *chip8){
+	static bool audio_playing = false;
+	if(chip8->delay_timer > 0)
+		chip8->delay_timer--;
+	if(chip8->sound_timer > 0){
+		chip8->sound_timer--;
+		if(!audio_playing) atomic_store_explicit(&audio_restarted, true, memory_order_relaxed);
+		audio_playing = true;
+		SDL_PauseAudioDevice(sdl.dev, 0);
+	} else{
+		audio_playing = false;
+		SDL_PauseAudioDevice(sdl.dev, 1);
+	}
+}
+
+// Frame pacing
+// With vsync, SDL_RenderPresent blocks until the next refresh of the display the window is on.
+// Otherwise, frames are paced against an absolute deadline : sleep while more than 2 ms remain,
+// then spin until the deadline, SDL_Delay alone is only accurate to the millisecond.
+// The CHIP8 speed is kept independent from the frame rate : instructions and 60 Hz timer ticks
+// are accumulated from the real time between two frames.
+#define PACING_HISTORY 240  // Frames kept for the overlay statistics
+#define PACING_SPIN_MS 2
+
+typedef struct {
+	pacing_t mode;
+	uint64_t frequency;
+	uint64_t frame_ticks;      // Target frame period in performance counter ticks
+	uint64_t deadline;         // Next frame deadline, hybrid mode only
+	uint64_t last_frame;
+	double inst_accumulator;   // Instructions owed to the CHIP8
+	double timer_accumulator;  // 60 Hz timer ticks owed to the CHIP8
+	uint64_t missed_frames;
+	float frame_times[PACING_HISTORY];  // In ms, present to present
+	uint32_t frame_count;
+	uint64_t ips_window_start;
+	uint64_t ips_window_insts;
+	uint32_t ips;              // Instructions really emulated during the last second
+	uint64_t insts;            // Totals since startup
+	uint64_t frames_emulated;
+	uint64_t frames_presented;
+	uint64_t sleep_ticks;      // Spent waiting for the deadline or vsync
+} pacer_t;
+
+void init_pacer(pacer_t *pacer, const pacing_t mode, const uint32_t refresh_rate){
+	memset(pacer, 0, sizeof(pacer_t));
+	pacer->mode = mode;
+	pacer->frequency = SDL_GetPerformanceFrequency();
+	// Vsync follows the display, the deadline pacing keeps the CHIP8 60 Hz
+	pacer->frame_ticks = pacer->frequency / (mode == PACING_VSYNC ? refresh_rate : 60);
+	pacer->last_frame = SDL_GetPerformanceCounter();
+	pacer->deadline = pacer->last_frame + pacer->frame_ticks;
+	pacer->ips_window_start = pacer->last_frame;
+}
+
+// Restart the frame clock after a pause or the debugger, the time spent there is not owed to the CHIP8
+// nor counted as missed frames
+void pacer_resume(pacer_t *pacer){
+	pacer->last_frame = SDL_GetPerformanceCounter();
+	pacer->deadline = pacer->last_frame + pacer->frame_ticks;
+}
+
+// Start a frame, returns how many instructions to emulate and how many timer ticks to apply
+uint32_t pacer_begin_frame(pacer_t *pacer, const config_t config, uint32_t *timer_ticks){
+	const uint64_t now = SDL_GetPerformanceCounter();
+	const uint64_t frame = now - pacer->last_frame;
+	double dt = (double)frame / pacer->frequency;
+	pacer->last_frame = now;
+
+	pacer->frame_times[pacer->frame_count++ % PACING_HISTORY] = dt * 1000;
+	// With vsync, a frame that took noticeably longer than a refresh skipped at least one
+	if(pacer->mode == PACING_VSYNC && frame > pacer->frame_ticks * 3 / 2)
+		pacer->missed_frames += (frame + pacer->frame_ticks / 2) / pacer->frame_ticks - 1;
+
+	// After a pause or a stall, do not try to catch up more than a few frames
+	if(dt > 0.1) dt = 0.1;
+
+	pacer->inst_accumulator += dt * config.insts_per_second;
+	pacer->timer_accumulator += dt * 60;
+	const uint32_t insts = (uint32_t)pacer->inst_accumulator;
+	*timer_ticks = (uint32_t)pacer->timer_accumulator;
+	pacer->inst_accumulator -= insts;
+	pacer->timer_accumulator -= *timer_ticks;
+
+	pacer->insts += insts;
+	pacer->frames_emulated += *timer_ticks;
+	pacer->ips_window_insts += insts;
+	if(now - pacer->ips_window_start >= pacer->frequency){
+		pacer->ips = pacer->ips_window_insts * pacer->frequency / (now - pacer->ips_window_start);
+		pacer->ips_window_start = now;
+		pacer->ips_window_insts = 0;
+	}
+	return insts;
+}
+
+// Wait for the frame deadline and present, with vsync SDL_RenderPresent does the waiting
+void pacer_present(pacer_t *pacer, SDL_Renderer *renderer){
+	const uint64_t start = SDL_GetPerformanceCounter();
+	pacer->frames_presented++;
+	if(pacer->mode == PACING_VSYNC){
+		SDL_RenderPresent(renderer);
+		pacer->sleep_ticks += SDL_GetPerformanceCounter() - start;
+		return;
+	}
+
+	uint64_t now = start;
+	if(now >= pacer->deadline + pacer->frame_ticks){
+		// More than a frame late, drop the missed frames instead of rushing to catch up
+		pacer->missed_frames += (now - pacer->deadline) / pacer->frame_ticks;
+		pacer->deadline = now;
+	} else {
+		const uint64_t spin_ticks = pacer->frequency * PACING_SPIN_MS / 1000;
+		while(now + spin_ticks < pacer->deadline){
+			SDL_Delay(1);
+			now = SDL_GetPerformanceCounter();
+		}
+		while(now < pacer->deadline)
+			now = SDL_GetPerformanceCounter();
+	}
+	pacer->deadline += pacer->frame_ticks;
+	pacer->sleep_ticks += now - start;
+	SDL_RenderPresent(renderer);
+}
+
+int compare_float(const void *a, const void *b){
+	const float fa = *(const float *)a;
+	const float fb = *(const float *)b;
+	return (fa > fb) - (fa < fb);
+}
+
+// 3x5 font for the overlay, one row per byte, bit 2 is the left column
+const uint8_t *overlay_glyph(const char c){
+	static const uint8_t glyphs[][5] = {
+		{0,0,0,0,0}, {7,5,5,5,7}, {2,6,2,2,7}, {7,1,7,4,7}, {7,1,7,1,7}, {5,5,7,1,1},
+		{7,4,7,1,7}, {7,4,7,5,7}, {7,1,1,1,1}, {7,5,7,5,7}, {7,5,7,1,7}, {0,0,0,0,2},
+		{2,5,7,5,5}, {6,5,6,5,6}, {7,4,4,4,7}, {6,5,5,5,6}, {7,4,7,4,7}, {7,4,7,4,4},
+		{7,4,5,5,7}, {5,5,7,5,5}, {7,2,2,2,7}, {1,1,1,5,7}, {5,5,6,5,5}, {4,4,4,4,7},
+		{5,7,7,5,5}, {6,5,5,5,5}, {7,5,5,5,7}, {7,5,7,4,4}, {7,5,5,7,1}, {6,5,6,5,5},
+		{7,4,7,1,7}, {7,2,2,2,2}, {5,5,5,5,7}, {5,5,5,5,2}, {5,5,7,7,5}, {5,5,2,5,5},
+		{5,5,2,2,2}, {7,1,2,4,7},
+	};
+	if(c >= '0' && c <= '9') return glyphs[1 + c - '0'];
+	if(c == '.') return glyphs[11];
+	if(c >= 'A' && c <= 'Z') return glyphs[12 + c - 'A'];
+	return glyphs[0];
+}
+
+void draw_overlay_text(const sdl_t sdl, int x, const int y, const int size, const char *text){
+	for(; *text; text++, x += 4 * size){
+		const uint8_t *glyph = overlay_glyph(*text);
+		for(int row = 0; row < 5; row++){
+			for(int col = 0; col < 3; col++){
+				if(!(glyph[row] & (4 >> col))) continue;
+				const SDL_Rect rect = {x + col * size, y + row * size, size, size};
+				SDL_RenderFillRect(sdl.renderer, &rect);
+			}
+		}
+	}
+}
+
+// Frame time percentiles, emulation speed and a frame time histogram (1 ms per bar, 0 to 40 ms)
+void draw_overlay(const sdl_t sdl, const pacer_t *pacer){
+	const uint32_t count = pacer->frame_count < PACING_HISTORY ? pacer->frame_count : PACING_HISTORY;
+	float sorted[PACING_HISTORY];
+	uint32_t histogram[40] = {0};
+	uint32_t histogram_max = 1;
+
+	memcpy(sorted, pacer->frame_times, count * sizeof(float));
+	qsort(sorted, count, sizeof(float), compare_float);
+	for(uint32_t i = 0; i < count; i++){
+		const uint32_t bucket = sorted[i] < 39 ? (uint32_t)sorted[i] : 39;
+		if(++histogram[bucket] > histogram_max) histogram_max = histogram[bucket];
+	}
+
+	char lines[5][32];
+	snprintf(lines[0], sizeof lines[0], "%s %u HZ", pacer->mode == PACING_VSYNC ? "VSYNC" : "HYBRID",
+			 (unsigned)((pacer->frequency + pacer->frame_ticks / 2) / pacer->frame_ticks));
+	snprintf(lines[1], sizeof lines[1], "P50 %.1f MS", count ? sorted[count * 50 / 100] : 0.0f);
+	snprintf(lines[2], sizeof lines[2], "P99 %.1f MS", count ? sorted[count * 99 / 100] : 0.0f);
+	snprintf(lines[3], sizeof lines[3], "IPS %u", pacer->ips);
+	snprintf(lines[4], sizeof lines[4], "MISSED %llu", (unsigned long long)pacer->missed_frames);
+
+	const int size = 2;
+	const int graph_height = 40;
+	const SDL_Rect background = {0, 0, 40 * 4 + 8, 5 * 6 * size + graph_height + 12};
+	SDL_SetRenderDrawBlendMode(sdl.renderer, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(sdl.renderer, 0, 0, 0, 0xC0);
+	SDL_RenderFillRect(sdl.renderer, &background);
+
+	SDL_SetRenderDrawColor(sdl.renderer, 0xFF, 0xFF, 0x00, 0xFF);
+	for(int i = 0; i < 5; i++)
+		draw_overlay_text(sdl, 4, 4 + i * 6 * size, size, lines[i]);
+
+	// Bars, the bucket holding the target frame time is drawn in green
+	const uint32_t target_bucket = pacer->frame_ticks * 1000 / pacer->frequency;
+	const int graph_bottom = background.h - 4;
+	for(uint32_t i = 0; i < 40; i++){
+		const int h = histogram[i] * graph_height / histogram_max;
+		const SDL_Rect bar = {4 + i * 4, graph_bottom - h, 3, h};
+		if(i == target_bucket)
+			SDL_SetRenderDrawColor(sdl.renderer, 0x00, 0xFF, 0x00, 0xFF);
+		else
+			SDL_SetRenderDrawColor(sdl.renderer, 0xFF, 0x40, 0x40, 0xFF);
+		SDL_RenderFillRect(sdl.renderer, &bar);
+	}
+	SDL_SetRenderDrawBlendMode(sdl.renderer, SDL_BLENDMODE_NONE);
+}
+
+// Live metrics
+// Published in shared memory for chip8-top, see chip8_metrics.h. Updated once per frame from
+// counters the main loop keeps anyway, so it stays enabled all the time.
+typedef struct {
+	chip8_metrics_t *shared;
+	char name[32];
+	uint64_t draws;
+} metrics_t;
+
+uint64_t wall_clock_ms(void){
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool metrics_open(metrics_t *metrics, const char *rom_name){
+	memset(metrics, 0, sizeof(metrics_t));
+#ifdef _WIN32
+	(void)rom_name;
+	return false;  // No POSIX shared memory
+#else
+	snprintf(metrics->name, sizeof metrics->name, "/" CHIP8_METRICS_PREFIX "%d", (int)getpid());
+	const int fd = shm_open(metrics->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, sizeof(chip8_metrics_t)) != 0){
+		SDL_Log("Could not create the metrics segment %s\n", metrics->name);
+		if(fd >= 0){
+			close(fd);
+			shm_unlink(metrics->name);
+		}
+		return false;
+	}
+	void *shared = mmap(NULL, sizeof(chip8_metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shared == MAP_FAILED){
+		shm_unlink(metrics->name);
+		return false;
+	}
+
+	metrics->shared = shared;
+	metrics->shared->version = CHIP8_METRICS_VERSION;
+	metrics->shared->pid = getpid();
+	const char *slash = strrchr(rom_name, '/');
+	snprintf(metrics->shared->rom_name, sizeof metrics->shared->rom_name, "%s", slash ? slash + 1 : rom_name);
+	atomic_store_explicit(&metrics->shared->start_ms, wall_clock_ms(), memory_order_relaxed);
+	atomic_store_explicit(&metrics->shared->sessions, 1, memory_order_relaxed);
+	// Readers ignore the block until the magic is there
+	atomic_thread_fence(memory_order_release);
+	metrics->shared->magic = CHIP8_METRICS_MAGIC;
+	return true;
+#endif
+}
+
+void metrics_update(metrics_t *metrics, const pacer_t *pacer, chip8_t *chip8){
+	metrics->draws += chip8->draws;
+	chip8->draws = 0;
+	if(!metrics->shared) return;
+
+	chip8_metrics_t *shared = metrics->shared;
+	atomic_store_explicit(&shared->update_ms, wall_clock_ms(), memory_order_relaxed);
+	atomic_store_explicit(&shared->state, chip8->state, memory_order_relaxed);
+	atomic_store_explicit(&shared->insts_per_second, pacer->ips, memory_order_relaxed);
+	atomic_store_explicit(&shared->insts, pacer->insts, memory_order_relaxed);
+	atomic_store_explicit(&shared->frames_emulated, pacer->frames_emulated, memory_order_relaxed);
+	atomic_store_explicit(&shared->frames_presented, pacer->frames_presented, memory_order_relaxed);
+	atomic_store_explicit(&shared->late_frames, pacer->missed_frames, memory_order_relaxed);
+	atomic_store_explicit(&shared->sleep_us, pacer->sleep_ticks * 1000000 / pacer->frequency, memory_order_relaxed);
+	atomic_store_explicit(&shared->audio_underruns, atomic_load_explicit(&audio_underruns, memory_order_relaxed), memory_order_relaxed);
+	atomic_store_explicit(&shared->draws, metrics->draws, memory_order_relaxed);
+}
+
+void metrics_close(metrics_t *metrics){
+#ifndef _WIN32
+	if(!metrics->shared) return;
+	munmap(metrics->shared, sizeof(chip8_metrics_t));
+	shm_unlink(metrics->name);
+	metrics->shared = NULL;
+#else
+	(void)metrics;
+#endif
+}
+
+// Keypad:	CHIP8	 AZERTY
+//			123C	 1234
+//			456D	 AZER
 //			789E	 QSDF
 //			A0BF	 WXCV
 void handle_input(chip8_t *chip8, config_t *config){
@@ -306,573 +2316,2806 @@ void handle_input(chip8_t *chip8, config_t *config){
 			case SDL_QUIT:
 				chip8->state = QUIT;
 				break;
-			case SDL_KEYDOWN:
-				switch (event.key.keysym.sym){
-					case SDLK_SPACE:
-						if(chip8->state == RUNNING){
-							chip8->state = PAUSED;
-							puts("==== PAUSED ====");
-						} else {
-							chip8->state = RUNNING;
-							puts("==== RUNNING ====");
-						}
-						break;
-					case SDLK_EQUALS:
-						init_chip8(chip8, *config, chip8->rom_name);
-						break;
-					case SDLK_p:
-						if(config->color_lerp_rate < 1.0)
-							config->color_lerp_rate += 0.1;
-						break;
-					case SDLK_m:
-						if(config->color_lerp_rate > 0.1)
-							config->color_lerp_rate -= 0.1;
-						break;
-					case SDLK_o:
-						if(config->volume < INT16_MAX)
-							config->volume += 500;
-						break;
-					case SDLK_l:
-						if(config->volume > 0)
-							config->volume -= 500;
-						break;
-					case SDLK_1: chip8->keypad[0x1] = true; break;
-					case SDLK_2: chip8->keypad[0x2] = true; break;
-					case SDLK_3: chip8->keypad[0x3] = true; break;
-					case SDLK_4: chip8->keypad[0xC] = true; break;
+			case SDL_KEYDOWN:
+				switch (event.key.keysym.sym){
+					case SDLK_SPACE:
+						if(chip8->state == RUNNING){
+							chip8->state = PAUSED;
+							puts("==== PAUSED ====");
+						} else if(chip8->state == PAUSED){
+							chip8->state = RUNNING;
+							puts("==== RUNNING ====");
+						}
+						break;
+					case SDLK_EQUALS:
+						init_chip8(chip8, *config, chip8->rom);
+						break;
+					case SDLK_p:
+						if(config->color_lerp_rate < 1.0)
+							config->color_lerp_rate += 0.1;
+						break;
+					case SDLK_m:
+						if(config->color_lerp_rate > 0.1)
+							config->color_lerp_rate -= 0.1;
+						break;
+					case SDLK_o:
+						if(config->volume < INT16_MAX)
+							config->volume += 500;
+						break;
+					case SDLK_l:
+						if(config->volume > 0)
+							config->volume -= 500;
+						break;
+					case SDLK_F1:
+						config->show_overlay = !config->show_overlay;
+						break;
+					case SDLK_F2:
+						config->upscale = (config->upscale + 1) % UPSCALE_COUNT;
+						break;
+					case SDLK_F3:
+						config->crt = (config->crt + 1) % CRT_COUNT;
+						break;
+					case SDLK_F5:
+						if(chip8->state == RUNNING){
+							chip8->state = STOPPED;
+							puts("==== STOPPED, debugger commands in the terminal ====");
+						}
+						break;
+					case SDLK_1: chip8->keypad[0x1] = true; break;
+					case SDLK_2: chip8->keypad[0x2] = true; break;
+					case SDLK_3: chip8->keypad[0x3] = true; break;
+					case SDLK_4: chip8->keypad[0xC] = true; break;
+
+					case SDLK_a: chip8->keypad[0x4] = true; break;
+					case SDLK_z: chip8->keypad[0x5] = true; break;
+					case SDLK_e: chip8->keypad[0x6] = true; break;
+					case SDLK_r: chip8->keypad[0xD] = true; break;
+
+					case SDLK_q: chip8->keypad[0x7] = true; break;
+					case SDLK_s: chip8->keypad[0x8] = true; break;
+					case SDLK_d: chip8->keypad[0x9] = true; break;
+					case SDLK_f: chip8->keypad[0xE] = true; break;
+
+					case SDLK_w: chip8->keypad[0xA] = true; break;
+					case SDLK_x: chip8->keypad[0x0] = true; break;
+					case SDLK_c: chip8->keypad[0xB] = true; break;
+					case SDLK_v: chip8->keypad[0xF] = true; break;
+
+					default : break;
+				}
+				break;
+			case SDL_KEYUP:
+				switch (event.key.keysym.sym){
+					case SDLK_1: chip8->keypad[0x1] = false; break;
+					case SDLK_2: chip8->keypad[0x2] = false; break;
+					case SDLK_3: chip8->keypad[0x3] = false; break;
+					case SDLK_4: chip8->keypad[0xC] = false; break;
+
+					case SDLK_a: chip8->keypad[0x4] = false; break;
+					case SDLK_z: chip8->keypad[0x5] = false; break;
+					case SDLK_e: chip8->keypad[0x6] = false; break;
+					case SDLK_r: chip8->keypad[0xD] = false; break;
+
+					case SDLK_q: chip8->keypad[0x7] = false; break;
+					case SDLK_s: chip8->keypad[0x8] = false; break;
+					case SDLK_d: chip8->keypad[0x9] = false; break;
+					case SDLK_f: chip8->keypad[0xE] = false; break;
+
+					case SDLK_w: chip8->keypad[0xA] = false; break;
+					case SDLK_x: chip8->keypad[0x0] = false; break;
+					case SDLK_c: chip8->keypad[0xB] = false; break;
+					case SDLK_v: chip8->keypad[0xF] = false; break;
+
+					default : break;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+void print_debug_info(chip8_t *chip8){
+	printf("Adress : 0x%04X, Opcode : 0x%04X Desc : ", chip8->PC-2, chip8->inst.opcode);
+	switch ((chip8->inst.opcode >> 12) & 0x0F){
+		case 0x00:
+			if(chip8->inst.X != 0){
+				printf("Unimplemented Opcode.\n");
+			} else if(chip8->inst.NN == 0xE0){
+				printf("Clear screen\n");
+			} else if(chip8->inst.NN == 0xEE){
+				printf("Return from subroutine to adress 0x%04X\n", *(chip8->stack_ptr - 1));
+			} else if(chip8->inst.N2 == 0x0C0){
+				printf("Scroll down the whole screen of %u \n", chip8->inst.N);
+			} else if(chip8->inst.NN == 0xFB) {
+				printf("Scroll right the whole screen of 4px \n");
+			} else if(chip8->inst.NN == 0xFC) {
+				printf("Scroll left the whole screen of 4px \n");
+			} else if(chip8->inst.NN == 0xFE) {
+				printf("Disable high resolution graphics mode and return to 64x32 \n");
+			} else if(chip8->inst.NN == 0xFF) {
+				printf("Enable 128x64 high resolution graphics mode \n");
+			} else if(chip8->inst.NN == 0xFD) {
+				printf("Exit the Chip8/SuperChip interpreter \n");
+			} else {
+				printf("Unimplemented Opcode.\n");
+			}
+			break;
+		case 0x01:
+			printf("Jump to address NNN (0x%04X)\n", chip8->inst.NNN);
+			break;
+		case 0x02:
+			printf("Call subroutine at NNN (0x%04X)\n", chip8->inst.NNN);
+			break;
+		case 0x03:
+			printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",
+					chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
+			break;
+		case 0x04:
+			printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",
+					chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
+			break;
+		case 0x05:
+			printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
+					chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+			break;
+		case 0x06:
+			printf("Set register V%X = NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
+			break;
+		case 0x07:
+			printf("Set register V%X (0x%02X) += NN (0x%02X). Result 0x%02X\n", 
+					chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->V[chip8->inst.X] + chip8->inst.NN);
+			break;
+		case 0x08:
+			switch (chip8->inst.N){
+				case 0:
+					printf("Set register V%X = V%X (0x%02X)\n", 
+							chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y]);
+					break;
+				case 1:
+					printf("Set register V%X (0x%02X) |= V%X (0x%02X). Result : 0x%02X\n", 
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
+							chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
+					break;
+				case 2:
+					printf("Set register V%X (0x%02X) &= V%X (0x%02X). Result : 0x%02X\n", 
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
+							chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
+					break;
+				case 3:
+					printf("Set register V%X (0x%02X) ^= V%X (0x%02X). Result : 0x%02X\n", 
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
+							chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
+					break;
+				case 4:
+					printf("Set register V%X (0x%02X) += V%X (0x%02X), VF = 1 if carry. Result : 0x%02X, VF = %X\n", 
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
+							chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y],
+							((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255));
+					break;
+				case 5:
+					printf("Set register V%X (0x%02X) -= V%X (0x%02X), VF = 1 if no borrow. Result : 0x%02X, VF = %X\n", 
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
+							chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y],
+							(chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]));
+					break;
+				case 6:
+					printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X). Result : 0x%02X\n", 
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] & 1,
+							chip8->V[chip8->inst.X] >> 1);
+					break;
+				case 7:
+					printf("Set register V%X = V%X (0x%02X) - V%X (0x%02X), VF = 1 if no borrow. Result : 0x%02X, VF = %X\n", 
+							chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y], 
+							chip8->inst.X, chip8->V[chip8->inst.X],
+							chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X],
+							(chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
+					break;
+				case 0xE:
+					printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X). Result : 0x%02X\n", 
+							chip8->inst.X, chip8->V[chip8->inst.X], (chip8->V[chip8->inst.X] & 0x80) >> 7,
+							chip8->V[chip8->inst.X] << 1);
+					break;
+				default:
+					printf("Unimplemented Opcode.\n");
+					break;
+			}
+			break;
+		case 0x09:
+			printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n",
+					chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+			break;
+		case 0x0A:
+			printf("Set I to NNN (0x%04X)\n", chip8->inst.NNN);
+			break;
+		case 0x0B:
+			printf("Set PC to V0 (0x%02X) + NNN (0x%04X). Result PC = 0x%04X\n", 
+					chip8->V[0], chip8->inst.NNN, chip8->V[0] + chip8->inst.NNN);
+			break;
+		case 0x0C:
+			printf("Set V%X = random & NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
+			break;
+		case 0x0D:
+			printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) "
+					"from memory location I (0x%04X). Set VF = 1 if any pixels are turned off.\n",
+					chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->I);
+			break;
+		case 0x0E:
+			if(chip8->inst.NN == 0x9E){
+				printf("Skip next instruction if key in V%X (0x%02X) is pressed. Keypad value: %d\n",
+						chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X] & 0xF]);
+			} else if(chip8->inst.NN == 0xA1){
+				printf("Skip next instruction if key in V%X (0x%02X) is not pressed. Keypad value: %d\n",
+						chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X] & 0xF]);
+			}
+			break;
+		case 0x0F:
+			switch (chip8->inst.NN) {
+				case 0x0A: {
+					printf("Await until a key is pressed. Stored key in V%X\n", chip8->inst.X);
+					break;
+				}
+				case 0x1E:
+					printf("I (0x%04X) += V%X (0x%02X). Result (I) : 0x%04X\n", 
+							chip8->I, chip8->inst.X, chip8->V[chip8->inst.X],
+							chip8->I + chip8->V[chip8->inst.X]);
+					break;
+				case 0x07:
+					printf("Set V%X = delay timer value (0x%02X)\n", chip8->inst.X, chip8->delay_timer);
+					break;
+				case 0x15:
+					printf("Set delay timer value = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+					break;
+				case 0x18:
+					printf("Set sound timer value = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+					break;
+				case 0x29:
+					printf("Set I to sprite location in memory for character in V%X (0x%02X). Result(VX*5) = (0x%02X)\n",
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] * 5);
+					break;
+				case 0x30:
+					printf("Point I to 10-byte font sprite for digit V%X (only digits 0-9)\n", chip8->inst.X);
+					break;
+				case 0x33:
+					printf("Store BCD representation of V%X (0x%02X) at memory form I (0x%04X)\n",
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+					break;
+				case 0x55:
+					printf("Register dumb V0-V%X (0x%02X) inclusive at memory form I (0x%04X)\n",
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+					break;
+				case 0x65:
+					printf("Register load V0-V%X (0x%02X) inclusive from memory form I (0x%04X)\n",
+							chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+					break;
+				default:
+					break;
+			}
+			break;
+		default :
+			printf("Unimplemented opcode.\n");
+			break;
+	}
+}
+
+// Quirk profiles
+// Each profile gets its own copy of the instruction set, see chip8_instructions.h
+#define QUIRK_FN_SUFFIX default
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_LOAD_STORE_INC_I 0
+#define QUIRK_JUMP_VX 0
+#define QUIRK_SPRITE_WRAP 0
+#define QUIRK_VF_RESET 0
+#include "chip8_instructions.h"
+
+// Original COSMAC VIP interpreter
+#define QUIRK_FN_SUFFIX chip8
+#define QUIRK_SHIFT_VY 1
+#define QUIRK_LOAD_STORE_INC_I 1
+#define QUIRK_JUMP_VX 0
+#define QUIRK_SPRITE_WRAP 0
+#define QUIRK_VF_RESET 1
+#include "chip8_instructions.h"
+
+// SUPER-CHIP 1.1
+#define QUIRK_FN_SUFFIX schip
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_LOAD_STORE_INC_I 0
+#define QUIRK_JUMP_VX 1
+#define QUIRK_SPRITE_WRAP 0
+#define QUIRK_VF_RESET 0
+#include "chip8_instructions.h"
+
+// XO-CHIP
+#define QUIRK_FN_SUFFIX xochip
+#define QUIRK_SHIFT_VY 1
+#define QUIRK_LOAD_STORE_INC_I 1
+#define QUIRK_JUMP_VX 0
+#define QUIRK_SPRITE_WRAP 1
+#define QUIRK_VF_RESET 0
+#include "chip8_instructions.h"
+
+const quirk_profile_t quirk_profiles[QUIRKS_COUNT] = {
+	[QUIRKS_DEFAULT] = {"default", emulate_instruction_default, emulate_instructions_default},
+	[QUIRKS_CHIP8] = {"chip8", emulate_instruction_chip8, emulate_instructions_chip8},
+	[QUIRKS_SCHIP] = {"schip", emulate_instruction_schip, emulate_instructions_schip},
+	[QUIRKS_XOCHIP] = {"xochip", emulate_instruction_xochip, emulate_instructions_xochip},
+};
+
+void emulate_instruction(chip8_t *chip8, config_t config){
+	quirk_profiles[config.quirks].emulate_instruction(chip8, config);
+}
+
+// Hot reload of Octo sources
+// The directory of the source is watched with inotify (editors often save by renaming a temporary
+// file), other platforms poll the modification time once per second. On change, the source is
+// assembled again and the code swapped into the running CHIP8. Registers, timers and display are
+// kept, the PC, I and return addresses follow the label they were relative to.
+typedef struct {
+	bool enabled;
+	int fd;
+	const char *file_name;  // Name of the source inside the watched directory
+	time_t mtime;
+	uint32_t polls;
+} source_watch_t;
+
+bool watch_source(source_watch_t *watch, const rom_t *rom){
+	memset(watch, 0, sizeof(source_watch_t));
+	if(!rom->octo) return false;
+
+	const char *slash = strrchr(rom->name, '/');
+	watch->file_name = slash ? slash + 1 : rom->name;
+	watch->enabled = true;
+#ifdef __linux__
+	char dir[4096] = ".";
+	if(slash) snprintf(dir, sizeof dir, "%.*s", (int)(slash - rom->name), rom->name);
+	watch->fd = inotify_init1(IN_NONBLOCK);
+	if(watch->fd >= 0 && inotify_add_watch(watch->fd, slash == rom->name ? "/" : dir, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0)
+		return true;
+	SDL_Log("Could not watch %s with inotify, polling it instead\n", rom->name);
+	if(watch->fd >= 0) close(watch->fd);
+#endif
+	watch->fd = -1;
+	struct stat st;
+	watch->mtime = stat(rom->name, &st) == 0 ? st.st_mtime : 0;
+	return true;
+}
+
+bool source_changed(source_watch_t *watch, const rom_t *rom){
+	if(!watch->enabled) return false;
+#ifdef __linux__
+	if(watch->fd >= 0){
+		char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		bool changed = false;
+		ssize_t length;
+		while((length = read(watch->fd, buffer, sizeof buffer)) > 0){
+			for(char *ptr = buffer; ptr < buffer + length; ){
+				const struct inotify_event *event = (const struct inotify_event *)ptr;
+				if(event->len && strcmp(event->name, watch->file_name) == 0) changed = true;
+				ptr += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		return changed;
+	}
+#endif
+	if(++watch->polls % 60) return false;
+	struct stat st;
+	if(stat(rom->name, &st) != 0 || st.st_mtime == watch->mtime) return false;
+	watch->mtime = st.st_mtime;
+	return true;
+}
+
+// Move an address from the old program to the new one, keeping its offset from the closest label
+uint16_t relocate_address(const octo_t *old_octo, const octo_t *new_octo, const uint16_t addr){
+	const octo_symbol_t *closest = NULL;
+	for(uint32_t i = 0; i < old_octo->symbol_count; i++){
+		const octo_symbol_t *symbol = &old_octo->symbols[i];
+		if(symbol->kind != OCTO_LABEL || !symbol->defined || symbol->value > addr) continue;
+		if(!closest || symbol->value > closest->value) closest = symbol;
+	}
+	if(!closest) return addr;
+
+	for(uint32_t i = 0; i < new_octo->symbol_count; i++){
+		const octo_symbol_t *symbol = &new_octo->symbols[i];
+		if(symbol->kind == OCTO_LABEL && symbol->defined && strcmp(symbol->name, closest->name) == 0)
+			return symbol->value + (addr - closest->value);
+	}
+	return addr;
+}
+
+void hot_reload(rom_t *rom, chip8_t *chip8){
+	const uint64_t start = SDL_GetPerformanceCounter();
+
+	// Keep the old program around until the CHIP8 state has been moved over
+	octo_t *old_octo = rom->octo;
+	uint8_t *old_data = rom->assembled;
+	const size_t old_size = rom->size;
+	rom->octo = NULL;
+	rom->assembled = NULL;
+
+	octo_t *new_octo;
+	if(!assemble_rom(rom, &new_octo) || rom->size > sizeof chip8->ram - 0x200){
+		if(rom->octo){
+			SDL_Log("%s is too big, keeping the running program\n", rom->name);
+			free(rom->octo->source);
+			octo_free(rom->octo);
+			free(rom->octo);
+			free(rom->assembled);
+		}
+		rom->octo = old_octo;
+		rom->assembled = old_data;
+		rom->data = old_data;
+		rom->size = old_size;
+		return;
+	}
+
+	chip8->PC = relocate_address(old_octo, new_octo, chip8->PC);
+	chip8->I = relocate_address(old_octo, new_octo, chip8->I);
+	for(uint16_t *ret = chip8->stack; ret < chip8->stack_ptr; ret++)
+		*ret = relocate_address(old_octo, new_octo, *ret);
+
+	if(old_size > rom->size)
+		memset(&chip8->ram[0x200 + rom->size], 0, old_size - rom->size);
+	memcpy(&chip8->ram[0x200], rom->data, rom->size);
+
+	// The debugger disassembles with the code map, code has moved
+	rom_metadata_t analysis;
+	analyze_rom(&analysis, chip8->ram);
+	memcpy(rom->metadata.code_map, analysis.code_map, sizeof analysis.code_map);
+
+	free(old_octo->source);
+	octo_free(old_octo);
+	free(old_octo);
+	free(old_data);
+
+	const double elapsed = (double)(SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency();
+	SDL_Log("Reloaded %s in %.2f ms\n", rom->name, elapsed);
+}
+
+// Binary execution trace
+// Every instruction is stored as a fixed size record in a single producer / single consumer
+// ring buffer. The emulator thread never blocks : if the writer thread falls behind, records
+// are dropped and counted. Use "chip8 --decode-trace <file>" to turn a trace into text.
+#define TRACE_MAGIC 0x52543843  // "C8TR"
+#define TRACE_VERSION 2
+#define TRACE_RING_SIZE (1 << 16)  // Records, must be a power of 2
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+} trace_header_t;
+
+typedef struct {
+	uint16_t PC;         // Address of the instruction
+	uint16_t opcode;
+	uint16_t I;          // Values below are taken before execution
+	uint16_t stack_top;  // Return address on top of the stack (0 if empty)
+	uint16_t changed;    // Bit n set if Vn was modified by the instruction
+	uint16_t keypad;     // Bit n set if key n is pressed
+	uint8_t delay_timer;
+	uint8_t sound_timer;
+	uint8_t stack_depth;
+	uint8_t after_gap;   // 1 if records were dropped just before this one
+	uint8_t V[16];
+	uint8_t V_after[16];
+} trace_record_t;
+
+typedef struct {
+	trace_record_t *ring;
+	atomic_size_t head;  // Written by the emulator thread only
+	atomic_size_t tail;  // Written by the writer thread only
+	atomic_bool stop;
+	uint64_t dropped;
+	bool gap;            // Records dropped since the last one written
+	FILE *file;
+	SDL_Thread *writer;
+} trace_t;
+
+int trace_writer_thread(void *data){
+	trace_t *trace = (trace_t *)data;
+
+	for(;;){
+		const bool stop = atomic_load_explicit(&trace->stop, memory_order_acquire);
+		const size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+		size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+		if(head == tail){
+			if(stop) break;
+			SDL_Delay(1);
+			continue;
+		}
+
+		// Write the contiguous part of the pending records, the wrapped part is picked up next pass
+		const size_t index = tail & (TRACE_RING_SIZE - 1);
+		size_t count = head - tail;
+		if(count > TRACE_RING_SIZE - index) count = TRACE_RING_SIZE - index;
+
+		fwrite(&trace->ring[index], sizeof(trace_record_t), count, trace->file);
+		atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+	}
+	return 0;
+}
+
+bool trace_open(trace_t *trace, const char *path){
+	memset(trace, 0, sizeof(trace_t));
+
+	trace->file = fopen(path, "wb");
+	if(!trace->file){
+		SDL_Log("Could not open trace file %s\n", path);
+		return false;
+	}
+
+	const trace_header_t header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(trace_record_t),
+	};
+	fwrite(&header, sizeof header, 1, trace->file);
+
+	trace->ring = malloc(TRACE_RING_SIZE * sizeof(trace_record_t));
+	if(!trace->ring){
+		SDL_Log("Could not allocate trace ring buffer\n");
+		fclose(trace->file);
+		return false;
+	}
+
+	trace->writer = SDL_CreateThread(trace_writer_thread, "trace_writer", trace);
+	if(!trace->writer){
+		SDL_Log("Could not create trace writer thread %s\n", SDL_GetError());
+		free(trace->ring);
+		fclose(trace->file);
+		return false;
+	}
+	return true;
+}
+
+void trace_close(trace_t *trace){
+	if(!trace->file) return;
+
+	atomic_store_explicit(&trace->stop, true, memory_order_release);
+	SDL_WaitThread(trace->writer, NULL);
+	fclose(trace->file);
+	free(trace->ring);
+
+	if(trace->dropped)
+		SDL_Log("Trace writer could not keep up, %llu records dropped\n", (unsigned long long)trace->dropped);
+	trace->file = NULL;
+}
+
+// Fill the part of a record known before the instruction runs
+void trace_record_begin(trace_record_t *record, const chip8_t *chip8){
+	const uint8_t stack_depth = chip8->stack_ptr - chip8->stack;
+
+	record->PC = chip8->PC;
+	record->I = chip8->I;
+	record->stack_top = stack_depth ? *(chip8->stack_ptr - 1) : 0;
+	record->delay_timer = chip8->delay_timer;
+	record->sound_timer = chip8->sound_timer;
+	record->stack_depth = stack_depth;
+	record->after_gap = 0;
+	record->keypad = 0;
+	for(uint8_t i = 0; i < 16; i++)
+		record->keypad |= chip8->keypad[i] << i;
+	memcpy(record->V, chip8->V, sizeof record->V);
+}
+
+void trace_record_end(trace_record_t *record, const chip8_t *chip8){
+	record->opcode = chip8->inst.opcode;
+	record->changed = 0;
+	for(uint8_t i = 0; i < 16; i++)
+		if(record->V[i] != chip8->V[i]) record->changed |= 1 << i;
+	memcpy(record->V_after, chip8->V, sizeof record->V_after);
+}
+
+// Emulate one instruction, recording it into the trace ring buffer
+void trace_instruction(trace_t *trace, chip8_t *chip8, const config_t config){
+	const size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+
+	if(head - tail >= TRACE_RING_SIZE){
+		trace->dropped++;
+		trace->gap = true;
+		emulate_instruction(chip8, config);
+		return;
+	}
+
+	trace_record_t *record = &trace->ring[head & (TRACE_RING_SIZE - 1)];
+	trace_record_begin(record, chip8);
+	emulate_instruction(chip8, config);
+	trace_record_end(record, chip8);
+	record->after_gap = trace->gap;
+	trace->gap = false;
+
+	atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+// Print a record with the same descriptions as the DEBUG build
+void print_trace_record(const trace_record_t *record){
+	static chip8_t chip8;
+
+	// Rebuild the machine state seen by the instruction, PC already points past it
+	memset(&chip8, 0, sizeof chip8);
+	decode_instruction(&chip8.inst, record->opcode);
+	chip8.PC = record->PC + 2;
+	chip8.I = record->I;
+	chip8.delay_timer = record->delay_timer;
+	chip8.sound_timer = record->sound_timer;
+	memcpy(chip8.V, record->V, sizeof chip8.V);
+	for(uint8_t i = 0; i < 16; i++)
+		chip8.keypad[i] = (record->keypad >> i) & 1;
+	chip8.stack_ptr = &chip8.stack[0];
+	if(record->stack_depth){
+		chip8.stack[0] = record->stack_top;
+		chip8.stack_ptr++;
+	}
+
+	print_debug_info(&chip8);
+
+	if(record->changed){
+		printf("    ->");
+		for(uint8_t i = 0; i < 16; i++)
+			if((record->changed >> i) & 1) printf(" V%X = 0x%02X", i, record->V_after[i]);
+		printf("\n");
+	}
+}
+
+// Offline decoder : print every record with the same descriptions as the DEBUG build
+bool decode_trace(const char *path){
+	FILE *file = fopen(path, "rb");
+	if(!file){
+		SDL_Log("Could not open trace file %s\n", path);
+		return false;
+	}
+
+	trace_header_t header;
+	if(fread(&header, sizeof header, 1, file) != 1 || header.magic != TRACE_MAGIC ||
+	   header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)){
+		SDL_Log("Trace file %s is invalid or from another version\n", path);
+		fclose(file);
+		return false;
+	}
+
+	trace_record_t record;
+	while(fread(&record, sizeof record, 1, file) == 1){
+		if(record.after_gap) printf("... records dropped here, the writer could not keep up ...\n");
+		print_trace_record(&record);
+	}
+
+	fclose(file);
+	return true;
+}
+
+// Debugger
+// F5 (or --debug to start there) stops the emulator and reads commands from the terminal, h lists
+// them. Breakpoints are flags in a bitmap indexed by address, watchpoints are found by decoding the
+// instruction about to run. The main loop only goes through debugger_run while a breakpoint,
+// a watchpoint or a step is set, otherwise the interpreter runs at full speed.
+// Addresses and values are hexadecimal, counts are decimal.
+#define DEBUGGER_MAX_WATCHPOINTS 16
+
+typedef enum {
+	CONDITION_NONE,
+	CONDITION_V,
+	CONDITION_I,
+} condition_kind_t;
+
+// Two character operators first, they would match as their first character otherwise
+const char *condition_ops[] = {"==", "!=", "<=", ">=", "<", ">"};
+
+typedef struct {
+	condition_kind_t kind;
+	uint8_t reg;  // For CONDITION_V
+	uint8_t op;   // Index in condition_ops
+	uint16_t value;
+} condition_t;
+
+typedef struct {
+	uint16_t start;
+	uint16_t end;  // Inclusive
+	bool read;
+	bool write;
+} watchpoint_t;
+
+// Terminal input, read on its own thread : fgets blocks and the main loop has to keep the window
+// and the metrics alive. The thread only reads a line when the debugger asks for one.
+typedef struct {
+	SDL_Thread *thread;
+	SDL_mutex *lock;
+	SDL_cond *wanted;
+	bool pending;    // A line was asked for
+	bool ready;      // line holds it
+	bool eof;
+	char line[256];
+} console_t;
+
+int console_thread(void *data){
+	console_t *console = (console_t *)data;
+	char line[256] = "";
+
+	SDL_LockMutex(console->lock);
+	for(;;){
+		while(!console->pending || console->ready)
+			SDL_CondWait(console->wanted, console->lock);
+		SDL_UnlockMutex(console->lock);
+		const bool eof = !fgets(line, sizeof line, stdin);
+		SDL_LockMutex(console->lock);
+		memcpy(console->line, line, sizeof line);
+		console->eof = eof;
+		console->ready = true;
+		if(eof) break;
+	}
+	SDL_UnlockMutex(console->lock);
+	return 0;
+}
+
+// Started the first time the debugger stops, it may stay blocked in fgets until exit
+bool console_open(console_t *console){
+	console->lock = SDL_CreateMutex();
+	console->wanted = SDL_CreateCond();
+	console->thread = console->lock && console->wanted ? SDL_CreateThread(console_thread, "console", console) : NULL;
+	if(!console->thread){
+		SDL_Log("Could not start the debugger console %s\n", SDL_GetError());
+		return false;
+	}
+	SDL_DetachThread(console->thread);
+	return true;
+}
+
+typedef struct {
+	uint8_t breakpoints[4096/8];  // Bit set for every address with a breakpoint
+	condition_t conditions[4096];
+	uint32_t breakpoint_count;
+	watchpoint_t watchpoints[DEBUGGER_MAX_WATCHPOINTS];
+	uint32_t watchpoint_count;
+	uint32_t steps;               // Instructions left before stopping, 0 when not stepping
+	bool step_over;               // Stop once PC is back at return_to with return_depth return addresses
+	uint16_t return_to;
+	uint8_t return_depth;
+	bool resumed;                 // Run the next instruction even if it has a breakpoint
+	const uint8_t *code_map;      // Reachable instructions found by the ROM analysis
+	console_t console;
+} debugger_t;
+
+bool debugger_is_code(const debugger_t *debugger, const uint16_t addr){
+	return (debugger->code_map[(addr & 0xFFF) / 8] >> (addr % 8)) & 1;
+}
+
+bool debugger_active(const debugger_t *debugger){
+	return debugger->breakpoint_count || debugger->watchpoint_count || debugger->steps || debugger->step_over;
+}
+
+bool debugger_condition(const condition_t *condition, const chip8_t *chip8){
+	if(condition->kind == CONDITION_NONE) return true;
+	const uint16_t value = condition->kind == CONDITION_V ? chip8->V[condition->reg] : chip8->I;
+	switch(condition->op){
+		case 0: return value == condition->value;
+		case 1: return value != condition->value;
+		case 2: return value <= condition->value;
+		case 3: return value >= condition->value;
+		case 4: return value < condition->value;
+		default: return value > condition->value;
+	}
+}
+
+// Memory the instruction at PC is about to access, false if it does not touch memory
+bool debugger_access(const chip8_t *chip8, uint16_t *start, uint16_t *end, bool *write){
+	instruction_t inst;
+	decode_instruction(&inst, chip8->ram[chip8->PC & 0xFFF] << 8 | chip8->ram[(chip8->PC + 1) & 0xFFF]);
+	const uint8_t op = inst.opcode >> 12;
+
+	*start = chip8->I & 0xFFF;
+	if(op == 0xD){
+		*end = *start + (inst.N ? inst.N : 32) - 1;  // DXY0 draws a 16x16 sprite
+		*write = false;
+	} else if(op == 0xF && inst.NN == 0x33){
+		*end = *start + 2;
+		*write = true;
+	} else if(op == 0xF && (inst.NN == 0x55 || inst.NN == 0x65)){
+		*end = *start + inst.X;
+		*write = inst.NN == 0x55;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void debugger_print_instruction(const chip8_t *chip8, const uint16_t addr){
+	static chip8_t scratch;
+	printf("%s", addr == chip8->PC ? "=> " : "   ");
+	memcpy(&scratch, chip8, sizeof scratch);
+	scratch.stack_ptr = &scratch.stack[chip8->stack_ptr - chip8->stack];
+	scratch.PC = addr + 2;
+	decode_instruction(&scratch.inst, chip8->ram[addr & 0xFFF] << 8 | chip8->ram[(addr + 1) & 0xFFF]);
+	// 00EE describes its return address, there is none with an empty stack
+	if(scratch.stack_ptr == scratch.stack) *scratch.stack_ptr++ = 0;
+	print_debug_info(&scratch);
+}
+
+// dis shows what the ROM analysis did not reach as data (sprites, or code only reached through BNNN)
+void debugger_disassemble(const debugger_t *debugger, const chip8_t *chip8, const uint16_t addr, const uint32_t count){
+	for(uint32_t i = 0; i < count; i++){
+		const uint16_t at = (addr + i * 2) & 0xFFF;
+		if(at == chip8->PC || debugger_is_code(debugger, at)){
+			debugger_print_instruction(chip8, at);
+		} else {
+			printf("   Adress : 0x%04X, Data : 0x%02X%02X\n", at, chip8->ram[at], chip8->ram[(at + 1) & 0xFFF]);
+		}
+	}
+}
+
+void debugger_stop(debugger_t *debugger, chip8_t *chip8){
+	chip8->state = STOPPED;
+	debugger->steps = 0;
+	debugger->step_over = false;
+	debugger_print_instruction(chip8, chip8->PC);
+}
+
+// Emulate up to count instructions, stopping on breakpoints, watchpoints and steps
+void debugger_run(debugger_t *debugger, chip8_t *chip8, const config_t config, const uint32_t count, trace_t *trace){
+	for(uint32_t i = 0; i < count && chip8->state == RUNNING; i++){
+		const uint16_t PC = chip8->PC;
+		const uint8_t depth = chip8->stack_ptr - chip8->stack;
+
+		if(!debugger->resumed){
+			if(debugger->step_over && PC == debugger->return_to && depth == debugger->return_depth){
+				debugger_stop(debugger, chip8);
+				return;
+			}
+			if((debugger->breakpoints[(PC & 0xFFF) / 8] >> (PC % 8)) & 1 &&
+			   debugger_condition(&debugger->conditions[PC & 0xFFF], chip8)){
+				printf("Breakpoint at 0x%03X\n", PC);
+				debugger_stop(debugger, chip8);
+				return;
+			}
+		}
+		debugger->resumed = false;
+
+		int hit = -1;
+		uint16_t start, end;
+		bool write;
+		if(debugger->watchpoint_count && debugger_access(chip8, &start, &end, &write)){
+			for(uint32_t w = 0; w < debugger->watchpoint_count && hit < 0; w++){
+				const watchpoint_t *watch = &debugger->watchpoints[w];
+				if(start <= watch->end && end >= watch->start && (write ? watch->write : watch->read)) hit = w;
+			}
+		}
+
+		if(trace->file){
+			trace_instruction(trace, chip8, config);
+		} else {
+			emulate_instruction(chip8, config);
+		}
+
+		// Watchpoints stop after the access, to show the values written
+		if(hit >= 0){
+			printf("Watchpoint %d : 0x%03X %s 0x%03X-0x%03X\n", hit, PC, write ? "wrote" : "read", start, end);
+			debugger_stop(debugger, chip8);
+			return;
+		}
+		if(debugger->steps && --debugger->steps == 0){
+			debugger_stop(debugger, chip8);
+			return;
+		}
+	}
+}
+
+bool parse_hex(const char *text, uint16_t *value){
+	if(!text) return false;
+	char *end;
+	const unsigned long parsed = strtoul(text, &end, 16);
+	if(*end || end == text || parsed > 0xFFFF) return false;
+	*value = parsed;
+	return true;
+}
+
+// b <addr> [if V<x>|I <op> <value>]
+bool debugger_breakpoint(debugger_t *debugger){
+	uint16_t addr;
+	if(!parse_hex(strtok(NULL, " \t\n"), &addr) || addr > 0xFFF) return false;
+
+	condition_t condition = {.kind = CONDITION_NONE};
+	const char *keyword = strtok(NULL, " \t\n");
+	if(keyword){
+		const char *operand = strtok(NULL, " \t\n");
+		const char *op = strtok(NULL, " \t\n");
+		if(strcmp(keyword, "if") != 0 || !operand || !op) return false;
+		if(toupper(operand[0]) == 'V' && isxdigit(operand[1]) && !operand[2]){
+			condition.kind = CONDITION_V;
+			condition.reg = isdigit(operand[1]) ? operand[1] - '0' : toupper(operand[1]) - 'A' + 10;
+		} else if(toupper(operand[0]) == 'I' && !operand[1]){
+			condition.kind = CONDITION_I;
+		} else {
+			return false;
+		}
+		for(condition.op = 0; condition.op < sizeof condition_ops / sizeof condition_ops[0]; condition.op++)
+			if(strcmp(op, condition_ops[condition.op]) == 0) break;
+		if(condition.op == sizeof condition_ops / sizeof condition_ops[0] ||
+		   !parse_hex(strtok(NULL, " \t\n"), &condition.value)) return false;
+	}
+
+	if(!debugger_is_code(debugger, addr))
+		printf("Warning : 0x%03X was not reached by the ROM analysis, it may be data or the middle of an instruction\n", addr);
+	if(!((debugger->breakpoints[addr / 8] >> (addr % 8)) & 1)) debugger->breakpoint_count++;
+	debugger->breakpoints[addr / 8] |= 1 << (addr % 8);
+	debugger->conditions[addr] = condition;
+	return true;
+}
+
+// w <start> [end] [r|w|rw]
+bool debugger_watchpoint(debugger_t *debugger){
+	watchpoint_t watch = {.write = true};
+	if(debugger->watchpoint_count == DEBUGGER_MAX_WATCHPOINTS ||
+	   !parse_hex(strtok(NULL, " \t\n"), &watch.start)) return false;
+	watch.end = watch.start;
+
+	const char *arg = strtok(NULL, " \t\n");
+	if(arg && parse_hex(arg, &watch.end)) arg = strtok(NULL, " \t\n");
+	if(arg){
+		watch.read = strchr(arg, 'r') != NULL;
+		watch.write = strchr(arg, 'w') != NULL;
+	}
+	if(watch.end < watch.start || watch.end > 0xFFF || (!watch.read && !watch.write)) return false;
+
+	debugger->watchpoints[debugger->watchpoint_count++] = watch;
+	return true;
+}
+
+void debugger_list(const debugger_t *debugger){
+	for(uint16_t addr = 0; addr < 4096; addr++){
+		if(!((debugger->breakpoints[addr / 8] >> (addr % 8)) & 1)) continue;
+		const condition_t *condition = &debugger->conditions[addr];
+		printf("Breakpoint 0x%03X", addr);
+		if(condition->kind == CONDITION_V) printf(" if V%X %s %X", condition->reg, condition_ops[condition->op], condition->value);
+		if(condition->kind == CONDITION_I) printf(" if I %s %X", condition_ops[condition->op], condition->value);
+		printf("\n");
+	}
+	for(uint32_t w = 0; w < debugger->watchpoint_count; w++){
+		const watchpoint_t *watch = &debugger->watchpoints[w];
+		printf("Watchpoint %u 0x%03X-0x%03X %s%s\n", w, watch->start, watch->end, watch->read ? "r" : "", watch->write ? "w" : "");
+	}
+}
+
+void debugger_registers(const chip8_t *chip8){
+	for(uint8_t i = 0; i < 16; i++)
+		printf("V%X=%02X%s", i, chip8->V[i], i % 8 == 7 ? "\n" : " ");
+	printf("I=%03X PC=%03X DT=%02X ST=%02X Keys=", chip8->I, chip8->PC, chip8->delay_timer, chip8->sound_timer);
+	for(uint8_t i = 0; i < 16; i++)
+		if(chip8->keypad[i]) printf("%X", i);
+	printf("\n");
+}
+
+void debugger_stack(const chip8_t *chip8){
+	const uint8_t depth = chip8->stack_ptr - chip8->stack;
+	if(!depth) printf("Stack empty\n");
+	for(uint8_t i = depth; i-- > 0;)
+		printf("#%u return to 0x%03X\n", depth - 1 - i, chip8->stack[i]);
+}
+
+void debugger_memory(const chip8_t *chip8, const uint16_t addr, const uint16_t size){
+	for(uint16_t row = 0; row < size; row += 16){
+		printf("%03X:", (addr + row) & 0xFFF);
+		for(uint16_t i = row; i < row + 16 && i < size; i++)
+			printf(" %02X", chip8->ram[(addr + i) & 0xFFF]);
+		printf("\n");
+	}
+}
+
+// Run one command line, c, s and n resume execution
+void debugger_command(debugger_t *debugger, chip8_t *chip8, char *line){
+	const char *command = strtok(line, " \t\n");
+	if(!command) return;
+	const char *arg = NULL;
+	uint16_t addr, size;
+
+	if(strcmp(command, "c") == 0){
+		chip8->state = RUNNING;
+		debugger->resumed = true;
+	} else if(strcmp(command, "s") == 0){
+		arg = strtok(NULL, " \t\n");
+		debugger->steps = arg ? (uint32_t)strtoul(arg, NULL, 10) : 1;
+		if(!debugger->steps) debugger->steps = 1;
+		chip8->state = RUNNING;
+		debugger->resumed = true;
+	} else if(strcmp(command, "n") == 0){
+		// Over a CALL, run until it returns (breakpoints inside still stop), otherwise one step
+		if(chip8->ram[chip8->PC & 0xFFF] >> 4 == 0x2){
+			debugger->step_over = true;
+			debugger->return_to = chip8->PC + 2;
+			debugger->return_depth = chip8->stack_ptr - chip8->stack;
+		} else {
+			debugger->steps = 1;
+		}
+		chip8->state = RUNNING;
+		debugger->resumed = true;
+	} else if(strcmp(command, "b") == 0){
+		if(!debugger_breakpoint(debugger)) printf("Usage : b <addr> [if V<x>|I ==|!=|<|>|<=|>= <value>]\n");
+	} else if(strcmp(command, "d") == 0){
+		if(parse_hex(strtok(NULL, " \t\n"), &addr) && addr <= 0xFFF && (debugger->breakpoints[addr / 8] >> (addr % 8)) & 1){
+			debugger->breakpoints[addr / 8] &= ~(1 << (addr % 8));
+			debugger->breakpoint_count--;
+		} else {
+			printf("No breakpoint there\n");
+		}
+	} else if(strcmp(command, "w") == 0){
+		if(!debugger_watchpoint(debugger)) printf("Usage : w <start> [end] [r|w|rw], %u watchpoints at most\n", DEBUGGER_MAX_WATCHPOINTS);
+	} else if(strcmp(command, "dw") == 0){
+		arg = strtok(NULL, " \t\n");
+		const uint32_t index = arg ? (uint32_t)strtoul(arg, NULL, 10) : UINT32_MAX;
+		if(index < debugger->watchpoint_count){
+			memmove(&debugger->watchpoints[index], &debugger->watchpoints[index + 1],
+					(debugger->watchpoint_count - index - 1) * sizeof(watchpoint_t));
+			debugger->watchpoint_count--;
+		} else {
+			printf("No watchpoint %s\n", arg ? arg : "");
+		}
+	} else if(strcmp(command, "l") == 0){
+		debugger_list(debugger);
+	} else if(strcmp(command, "r") == 0){
+		debugger_registers(chip8);
+	} else if(strcmp(command, "bt") == 0){
+		debugger_stack(chip8);
+	} else if(strcmp(command, "x") == 0){
+		if(!parse_hex(strtok(NULL, " \t\n"), &addr)) addr = chip8->I;
+		if(!parse_hex(strtok(NULL, " \t\n"), &size)) size = 0x40;
+		debugger_memory(chip8, addr, size);
+	} else if(strcmp(command, "dis") == 0){
+		if(!parse_hex(strtok(NULL, " \t\n"), &addr)) addr = chip8->PC;
+		arg = strtok(NULL, " \t\n");
+		debugger_disassemble(debugger, chip8, addr, arg ? (uint32_t)strtoul(arg, NULL, 10) : 8);
+	} else if(strcmp(command, "q") == 0){
+		chip8->state = QUIT;
+	} else {
+		printf("c              continue\n"
+			   "s [count]      step count instructions\n"
+			   "n              step, over a CALL\n"
+			   "b <addr> [if V<x>|I <op> <value>]  breakpoint, op is one of == != < > <= >=\n"
+			   "d <addr>       delete a breakpoint\n"
+			   "w <start> [end] [r|w|rw]  watch memory accesses (writes by default)\n"
+			   "dw <n>         delete watchpoint n\n"
+			   "l              list breakpoints and watchpoints\n"
+			   "r              registers\n"
+			   "bt             stack\n"
+			   "x [addr] [size]  memory dump (default at I)\n"
+			   "dis [addr] [count]  disassemble (default at PC)\n"
+			   "q              quit\n");
+	}
+}
+
+// Called by the main loop while stopped : prompt once, run the command once its line has come
+void debugger_poll(debugger_t *debugger, chip8_t *chip8){
+	console_t *console = &debugger->console;
+	if(!console->thread && !console_open(console)){
+		chip8->state = QUIT;
+		return;
+	}
+
+	char line[sizeof console->line];
+	SDL_LockMutex(console->lock);
+	if(!console->pending){
+		printf("(chip8) ");
+		fflush(stdout);
+		console->pending = true;
+		SDL_CondSignal(console->wanted);
+		SDL_UnlockMutex(console->lock);
+		return;
+	}
+	if(!console->ready){
+		SDL_UnlockMutex(console->lock);
+		return;
+	}
+	memcpy(line, console->line, sizeof line);
+	const bool eof = console->eof;
+	console->pending = false;
+	console->ready = false;
+	SDL_UnlockMutex(console->lock);
+
+	if(eof){
+		chip8->state = QUIT;
+		return;
+	}
+	debugger_command(debugger, chip8, line);
+}
+
+// Lockstep validation
+// chip8 --validate <rom> runs a ROM on two machines : the reference runs reference_instruction
+// below, the fast path runs the selected profile's emulate_instructions (chip8_instructions.h)
+// over whole blocks. Both get the same keypad changes and the same CXNN seed, and are compared
+// after each block (--block 1 compares after every instruction). The first divergence stops the
+// run and shows the last instructions of the reference. chip8 --fuzz does the same over random
+// programs.
+// The interpreter does not check the stack or memory bounds, so the reference is checked before
+// every instruction : random programs leave the machine all the time, real ROMs should not.
+#define VALIDATOR_WINDOW 16
+
+typedef enum {
+	FAULT_NONE,
+	FAULT_PC,
+	FAULT_STACK_OVERFLOW,
+	FAULT_STACK_UNDERFLOW,
+	FAULT_MEMORY,
+	FAULT_COUNT,
+} fault_t;
+
+const char *fault_names[FAULT_COUNT] = {"none", "PC out of memory", "stack overflow", "stack underflow", "memory access out of bounds"};
+
+// Reference interpreter
+// A plain switch written apart from chip8_instructions.h : quirks are read at run time from the
+// table below instead of being resolved by the preprocessor, and it shares no code with the
+// generated profiles. Slow, only the validator uses it.
+typedef struct {
+	bool shift_vy;          // 8XY6/8XYE shift VY into VX
+	bool load_store_inc_i;  // FX55/FX65 leave I incremented
+	bool jump_vx;           // BXNN jumps to XNN + VX
+	bool sprite_wrap;       // Sprites wrap around the screen edges
+	bool vf_reset;          // 8XY1/8XY2/8XY3 reset VF
+} quirk_flags_t;
+
+const quirk_flags_t quirk_flags[QUIRKS_COUNT] = {
+	[QUIRKS_DEFAULT] = {0},
+	[QUIRKS_CHIP8] = {.shift_vy = true, .load_store_inc_i = true, .vf_reset = true},
+	[QUIRKS_SCHIP] = {.jump_vx = true},
+	[QUIRKS_XOCHIP] = {.shift_vy = true, .load_store_inc_i = true, .sprite_wrap = true},
+};
+
+// XOR one pixel in, returns true when it was already set
+bool reference_pixel(chip8_t *chip8, const quirk_flags_t *flags, uint32_t x, uint32_t y){
+	if(flags->sprite_wrap){
+		x %= chip8->width;
+		y %= chip8->height;
+	} else if(x >= chip8->width || y >= chip8->height){
+		return false;
+	}
+	bool *pixel = &chip8->display[y * chip8->width + x];
+	const bool collision = *pixel;
+	*pixel = !*pixel;
+	return collision;
+}
+
+// Move the display by dx, dy pixels, what comes in is blank
+void reference_scroll(chip8_t *chip8, const int dx, const int dy){
+	static bool display[128*64];
+	const int width = chip8->width, height = chip8->height;
+
+	memset(display, false, sizeof display);
+	for(int y = 0; y < height; y++){
+		for(int x = 0; x < width; x++){
+			if(x - dx < 0 || x - dx >= width || y - dy < 0 || y - dy >= height) continue;
+			display[y * width + x] = chip8->display[(y - dy) * width + (x - dx)];
+		}
+	}
+	memcpy(chip8->display, display, sizeof display);
+}
+
+void reference_instruction(chip8_t *chip8, const config_t config){
+	const quirk_flags_t *flags = &quirk_flags[config.quirks];
+	const uint16_t opcode = chip8->ram[chip8->PC] << 8 | chip8->ram[chip8->PC + 1];
+	const uint8_t x = (opcode >> 8) & 0xF;
+	const uint8_t y = (opcode >> 4) & 0xF;
+	const uint8_t n = opcode & 0xF;
+	const uint8_t nn = opcode & 0xFF;
+	const uint16_t nnn = opcode & 0xFFF;
+	uint8_t *V = chip8->V;
+
+	chip8->inst.opcode = opcode;  // For the trace records
+	chip8->PC += 2;
+
+	switch(opcode >> 12){
+		case 0x0:
+			if(opcode == 0x00E0) memset(chip8->display, false, sizeof chip8->display);
+			else if(opcode == 0x00EE) chip8->PC = *--chip8->stack_ptr;
+			else if((opcode & 0xFFF0) == 0x00C0) reference_scroll(chip8, 0, n);
+			else if(opcode == 0x00FB) reference_scroll(chip8, 4, 0);
+			else if(opcode == 0x00FC) reference_scroll(chip8, -4, 0);
+			else if(opcode == 0x00FD){
+				chip8->state = QUIT;
+				chip8->PC -= 2;
+			} else if(opcode == 0x00FE || opcode == 0x00FF){
+				// The display layout follows the width, what was drawn is lost
+				chip8->super_mode = opcode == 0x00FF;
+				chip8->width = chip8->super_mode ? 128 : 64;
+				chip8->height = chip8->super_mode ? 64 : 32;
+				memset(chip8->display, false, sizeof chip8->display);
+			}
+			break;
+		case 0x1:
+			chip8->PC = nnn;
+			break;
+		case 0x2:
+			*chip8->stack_ptr++ = chip8->PC;
+			chip8->PC = nnn;
+			break;
+		case 0x3:
+			if(V[x] == nn) chip8->PC += 2;
+			break;
+		case 0x4:
+			if(V[x] != nn) chip8->PC += 2;
+			break;
+		case 0x5:
+			if(n == 0 && V[x] == V[y]) chip8->PC += 2;
+			break;
+		case 0x6:
+			V[x] = nn;
+			break;
+		case 0x7:
+			V[x] += nn;
+			break;
+		case 0x8: {
+			// The flag is written last, it wins when X is F
+			const uint8_t vx = V[x], vy = V[y];
+			const uint8_t source = flags->shift_vy ? vy : vx;
+			switch(n){
+				case 0x0: V[x] = vy; break;
+				case 0x1: V[x] = vx | vy; if(flags->vf_reset) V[0xF] = 0; break;
+				case 0x2: V[x] = vx & vy; if(flags->vf_reset) V[0xF] = 0; break;
+				case 0x3: V[x] = vx ^ vy; if(flags->vf_reset) V[0xF] = 0; break;
+				case 0x4: V[x] = vx + vy; V[0xF] = vx + vy > 0xFF; break;
+				case 0x5: V[x] = vx - vy; V[0xF] = vx >= vy; break;
+				case 0x6: V[x] = source >> 1; V[0xF] = source & 1; break;
+				case 0x7: V[x] = vy - vx; V[0xF] = vy >= vx; break;
+				case 0xE: V[x] = source << 1; V[0xF] = source >> 7; break;
+				default: break;
+			}
+			break;
+		}
+		case 0x9:
+			if(V[x] != V[y]) chip8->PC += 2;
+			break;
+		case 0xA:
+			chip8->I = nnn;
+			break;
+		case 0xB:
+			chip8->PC = nnn + (flags->jump_vx ? V[x] : V[0]);
+			break;
+		case 0xC:
+			chip8->random = chip8->random * 1103515245 + 12345;
+			V[x] = (chip8->random >> 16) & nn;
+			break;
+		case 0xD: {
+			// 16x16 sprites (two bytes per row) with DXY0 in SCHIP resolution, 8xN otherwise
+			const bool wide = chip8->super_mode && n == 0;
+			const uint8_t rows = wide ? 16 : n, columns = wide ? 16 : 8;
+			const uint32_t left = V[x] % chip8->width, top = V[y] % chip8->height;
+
+			chip8->draws++;
+			V[0xF] = 0;
+			for(uint8_t row = 0; row < rows; row++){
+				const uint16_t bits = wide ? chip8->ram[chip8->I + 2*row] << 8 | chip8->ram[chip8->I + 2*row + 1]
+										   : chip8->ram[chip8->I + row] << 8;
+				for(uint8_t column = 0; column < columns; column++){
+					if(!(bits & (0x8000 >> column))) continue;
+					if(reference_pixel(chip8, flags, left + column, top + row)) V[0xF] = 1;
+				}
+			}
+			break;
+		}
+		case 0xE:
+			if(nn == 0x9E && chip8->keypad[V[x] & 0xF]) chip8->PC += 2;
+			else if(nn == 0xA1 && !chip8->keypad[V[x] & 0xF]) chip8->PC += 2;
+			break;
+		case 0xF:
+			switch(nn){
+				case 0x07:
+					V[x] = chip8->delay_timer;
+					break;
+				case 0x0A: {
+					// Wait on this instruction until a key is down, the lowest one wins
+					uint8_t key = 0;
+					while(key < 16 && !chip8->keypad[key]) key++;
+					if(key < 16) V[x] = key;
+					else chip8->PC -= 2;
+					break;
+				}
+				case 0x15:
+					chip8->delay_timer = V[x];
+					chip8->stores++;
+					break;
+				case 0x18:
+					chip8->sound_timer = V[x];
+					chip8->stores++;
+					break;
+				case 0x1E:
+					chip8->I += V[x];
+					break;
+				case 0x29:
+					chip8->I = V[x] * 5;
+					break;
+				case 0x30:
+					chip8->I = 80 + V[x] * 10;
+					break;
+				case 0x33:
+					chip8->ram[chip8->I] = V[x] / 100;
+					chip8->ram[chip8->I + 1] = V[x] / 10 % 10;
+					chip8->ram[chip8->I + 2] = V[x] % 10;
+					chip8->stores++;
+					break;
+				case 0x55:
+					memcpy(&chip8->ram[chip8->I], V, x + 1);
+					if(flags->load_store_inc_i) chip8->I += x + 1;
+					chip8->stores++;
+					break;
+				case 0x65:
+					memcpy(V, &chip8->ram[chip8->I], x + 1);
+					if(flags->load_store_inc_i) chip8->I += x + 1;
+					break;
+				default:
+					break;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+typedef struct {
+	chip8_t reference;
+	chip8_t fast;
+	config_t config;
+	const quirk_profile_t *quirks;
+	uint32_t block;
+	uint32_t inst_remainder;
+	uint64_t random;                          // Keypad changes
+	trace_record_t window[VALIDATOR_WINDOW];  // Last instructions of the reference
+	uint64_t insts;
+	fault_t fault;
+} validator_t;
+
+uint32_t validator_random(uint64_t *random){
+	*random = *random * 6364136223846793005 + 1442695040888963407;
+	return *random >> 33;
+}
+
+// Would the next instruction go outside the machine
+fault_t validator_fault(const chip8_t *chip8){
+	if(chip8->PC > sizeof chip8->ram - 2) return FAULT_PC;
+
+	instruction_t inst;
+	decode_instruction(&inst, chip8->ram[chip8->PC] << 8 | chip8->ram[chip8->PC + 1]);
+	const uint8_t op = inst.opcode >> 12;
+	const uint8_t depth = chip8->stack_ptr - chip8->stack;
+
+	if(op == 0x2 && depth == sizeof chip8->stack / sizeof chip8->stack[0]) return FAULT_STACK_OVERFLOW;
+	if(inst.opcode == 0x00EE && depth == 0) return FAULT_STACK_UNDERFLOW;
+	if(op == 0xD && chip8->I + (inst.N ? inst.N : 32) > (int)sizeof chip8->ram) return FAULT_MEMORY;
+	if(op == 0xF && inst.NN == 0x33 && chip8->I + 3 > (int)sizeof chip8->ram) return FAULT_MEMORY;
+	if(op == 0xF && (inst.NN == 0x55 || inst.NN == 0x65) && chip8->I + inst.X + 1 > (int)sizeof chip8->ram) return FAULT_MEMORY;
+	return FAULT_NONE;
+}
+
+// Compare the two machines, printing every difference when print is set
+bool validator_compare(const validator_t *validator, const bool print){
+	const chip8_t *ref = &validator->reference;
+	const chip8_t *fast = &validator->fast;
+	const uint8_t ref_depth = ref->stack_ptr - ref->stack;
+	const uint8_t fast_depth = fast->stack_ptr - fast->stack;
+	bool same = true;
+
+	if(ref->PC != fast->PC){
+		same = false;
+		if(print) printf("PC : reference 0x%03X, fast path 0x%03X\n", ref->PC, fast->PC);
+	}
+	if(ref->I != fast->I){
+		same = false;
+		if(print) printf("I : reference 0x%03X, fast path 0x%03X\n", ref->I, fast->I);
+	}
+	for(uint8_t i = 0; i < 16; i++){
+		if(ref->V[i] == fast->V[i]) continue;
+		same = false;
+		if(print) printf("V%X : reference 0x%02X, fast path 0x%02X\n", i, ref->V[i], fast->V[i]);
+	}
+	if(ref->delay_timer != fast->delay_timer || ref->sound_timer != fast->sound_timer){
+		same = false;
+		if(print) printf("Timers : reference DT 0x%02X ST 0x%02X, fast path DT 0x%02X ST 0x%02X\n",
+						 ref->delay_timer, ref->sound_timer, fast->delay_timer, fast->sound_timer);
+	}
+	if(ref->width != fast->width || ref->height != fast->height){
+		same = false;
+		if(print) printf("Resolution : reference %ux%u, fast path %ux%u\n", ref->width, ref->height, fast->width, fast->height);
+	}
+	if(ref->state != fast->state){
+		same = false;
+		if(print) printf("State : reference %d, fast path %d\n", ref->state, fast->state);
+	}
+	if(ref_depth != fast_depth || memcmp(ref->stack, fast->stack, ref_depth * sizeof ref->stack[0]) != 0){
+		same = false;
+		if(print){
+			printf("Stack : reference");
+			for(uint8_t i = 0; i < ref_depth; i++) printf(" 0x%03X", ref->stack[i]);
+			printf(", fast path");
+			for(uint8_t i = 0; i < fast_depth; i++) printf(" 0x%03X", fast->stack[i]);
+			printf("\n");
+		}
+	}
+	if(memcmp(ref->ram, fast->ram, sizeof ref->ram) != 0){
+		same = false;
+		uint16_t addr = 0;
+		while(ref->ram[addr] == fast->ram[addr]) addr++;
+		if(print) printf("RAM : hash reference %016llX, fast path %016llX, first difference at 0x%03X (0x%02X, 0x%02X)\n",
+						 (unsigned long long)hash_rom(ref->ram, sizeof ref->ram), (unsigned long long)hash_rom(fast->ram, sizeof fast->ram),
+						 addr, ref->ram[addr], fast->ram[addr]);
+	}
+	if(memcmp(ref->display, fast->display, sizeof ref->display) != 0){
+		same = false;
+		uint16_t i = 0;
+		while(ref->display[i] == fast->display[i]) i++;
+		if(print) printf("Display : first difference at pixel %u (x %u, y %u)\n",
+						 i, i % ref->width, i / ref->width);
+	}
+	return same;
+}
+
+// Last instructions of the reference, oldest first
+void validator_print_window(const validator_t *validator){
+	const uint64_t count = validator->insts < VALIDATOR_WINDOW ? validator->insts : VALIDATOR_WINDOW;
+	for(uint64_t n = validator->insts - count; n < validator->insts; n++){
+		printf("#%-8llu ", (unsigned long long)n);
+		print_trace_record(&validator->window[n % VALIDATOR_WINDOW]);
+	}
+}
+
+bool validator_init(validator_t *validator, const config_t config, const rom_t *rom, const uint32_t block, const uint64_t seed){
+	validator->config = config;
+	validator->quirks = &quirk_profiles[config.quirks];
+	validator->block = block;
+	validator->inst_remainder = 0;
+	validator->random = seed;
+	validator->insts = 0;
+	validator->fault = FAULT_NONE;
+	if(!init_chip8(&validator->reference, config, rom) || !init_chip8(&validator->fast, config, rom)) return false;
+	validator->reference.random = validator->fast.random = (uint32_t)seed;
+	return true;
+}
+
+// Run count instructions on both machines, false when they diverge
+bool validator_block(validator_t *validator, const uint32_t count){
+	uint32_t executed = 0;
+	while(executed < count && validator->reference.state == RUNNING){
+		validator->fault = validator_fault(&validator->reference);
+		if(validator->fault) break;
+		trace_record_t *record = &validator->window[validator->insts++ % VALIDATOR_WINDOW];
+		trace_record_begin(record, &validator->reference);
+		reference_instruction(&validator->reference, validator->config);
+		trace_record_end(record, &validator->reference);
+		executed++;
+	}
+
+	// Same instruction count, so a fault or an exit lands on the same boundary
+	validator->quirks->emulate_instructions(&validator->fast, validator->config, executed);
+	return validator_compare(validator, false);
+}
+
+// One 60 Hz frame : keypad change, instructions in blocks, timers. False when the machines diverge,
+// the run also ends on a fault or when the program exits.
+bool validator_frame(validator_t *validator){
+	if(validator_random(&validator->random) % 4 == 0){
+		const uint8_t key = validator_random(&validator->random) % 16;
+		validator->reference.keypad[key] = !validator->reference.keypad[key];
+		validator->fast.keypad[key] = validator->reference.keypad[key];
+	}
+
+	validator->inst_remainder += validator->config.insts_per_second;
+	uint32_t insts = validator->inst_remainder / 60;
+	validator->inst_remainder %= 60;
+	while(insts && validator->reference.state == RUNNING && !validator->fault){
+		const uint32_t count = insts < validator->block ? insts : validator->block;
+		if(!validator_block(validator, count)) return false;
+		insts -= count;
+	}
+
+	chip8_t *machines[] = {&validator->reference, &validator->fast};
+	for(uint8_t i = 0; i < 2; i++){
+		if(machines[i]->delay_timer > 0) machines[i]->delay_timer--;
+		if(machines[i]->sound_timer > 0) machines[i]->sound_timer--;
+	}
+	return true;
+}
+
+void validator_report_divergence(const validator_t *validator){
+	printf("Divergence after %llu instructions (%s quirks, block of %u), last instructions of the reference :\n",
+		   (unsigned long long)validator->insts, validator->quirks->name, validator->block);
+	validator_print_window(validator);
+	validator_compare(validator, true);
+}
+
+// Options common to --validate and --fuzz, the others are read by set_config_from_args
+void validator_options(const int argc, char **argv, uint32_t *block, uint32_t *frames, uint64_t *seed, uint32_t *programs){
+	for(int i = 1; i + 1 < argc; i++){
+		if(strncmp(argv[i], "--block", strlen("--block")) == 0) *block = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if(strncmp(argv[i], "--frames", strlen("--frames")) == 0) *frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if(strncmp(argv[i], "--seed", strlen("--seed")) == 0) *seed = strtoull(argv[++i], NULL, 10);
+		else if(strncmp(argv[i], "--programs", strlen("--programs")) == 0) *programs = (uint32_t)strtoul(argv[++i], NULL, 10);
+	}
+	if(!*block) *block = 1;
+}
+
+bool validate_rom(const char *rom_name, const int argc, char **argv){
+	static validator_t validator;
+	uint32_t block = 1, frames = 600, programs = 0;
+	uint64_t seed = 1;
+	validator_options(argc, argv, &block, &frames, &seed, &programs);
+
+	rom_t rom = {0};
+	if(!load_rom(&rom, rom_name, false)) return false;  // Validation leaves the cache alone
+	config_t config;
+	if(!set_config_from_args(&config, &rom.metadata, argc, argv) ||
+	   !validator_init(&validator, config, &rom, block, seed)){
+		unmap_rom(&rom);
+		return false;
+	}
+
+	bool ok = true;
+	uint32_t frame;
+	for(frame = 0; frame < frames && validator.reference.state == RUNNING && !validator.fault; frame++){
+		if(!validator_frame(&validator)){
+			validator_report_divergence(&validator);
+			ok = false;
+			break;
+		}
+	}
+	if(ok && validator.fault){
+		printf("Fault : %s at 0x%03X, last instructions :\n", fault_names[validator.fault], validator.reference.PC);
+		validator_print_window(&validator);
+		ok = false;
+	}
+	if(ok) printf("%llu instructions over %u frames (%s quirks, block of %u, seed %llu) : no divergence\n",
+				  (unsigned long long)validator.insts, frame, validator.quirks->name, block, (unsigned long long)seed);
+	unmap_rom(&rom);
+	return ok;
+}
+
+// Random instructions, every opcode family with operands that make sense for it
+void fuzz_program(validator_t *validator, uint8_t *program, const uint16_t size){
+	const uint16_t zero_ops[] = {0x00E0, 0x00EE, 0x00C0, 0x00FB, 0x00FC, 0x00FE, 0x00FF};
+	const uint8_t alu_ops[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE};
+	const uint8_t misc_ops[] = {0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x30, 0x33, 0x55, 0x65};
+
+	for(uint16_t i = 0; i < size; i += 2){
+		const uint32_t r = validator_random(&validator->random);
+		const uint32_t pick = validator_random(&validator->random);
+		uint16_t opcode = (r & 0xF) << 12 | ((r >> 4) & 0xFFF);
+		switch(opcode >> 12){
+			case 0x0:
+				opcode = zero_ops[pick % (sizeof zero_ops / sizeof zero_ops[0])];
+				if(opcode == 0x00C0) opcode |= (r >> 4) & 0xF;
+				break;
+			case 0x1:
+			case 0x2:
+			case 0xB:
+				opcode = (opcode & 0xF000) | (0x200 + (pick % size & ~1));  // Stay inside the program
+				break;
+			case 0x8:
+				opcode = (opcode & 0xFFF0) | alu_ops[pick % sizeof alu_ops];
+				break;
+			case 0xE:
+				opcode = (opcode & 0xFF00) | (pick & 1 ? 0x9E : 0xA1);
+				break;
+			case 0xF:
+				opcode = (opcode & 0xFF00) | misc_ops[pick % sizeof misc_ops];
+				break;
+			default:
+				break;
+		}
+		program[i] = opcode >> 8;
+		program[i + 1] = opcode & 0xFF;
+	}
+}
 
-					case SDLK_a: chip8->keypad[0x4] = true; break;
-					case SDLK_z: chip8->keypad[0x5] = true; break;
-					case SDLK_e: chip8->keypad[0x6] = true; break;
-					case SDLK_r: chip8->keypad[0xD] = true; break;
+// Headless fuzzing : every program is validated like a ROM, a fault only ends that program
+bool fuzz(const int argc, char **argv){
+	static validator_t validator;
+	static uint8_t program[512];
+	static uint8_t ram[4096];
+	uint32_t block = 1, frames = 30, programs = 1000;
+	uint64_t seed = 1;
+	validator_options(argc, argv, &block, &frames, &seed, &programs);
 
-					case SDLK_q: chip8->keypad[0x7] = true; break;
-					case SDLK_s: chip8->keypad[0x8] = true; break;
-					case SDLK_d: chip8->keypad[0x9] = true; break;
-					case SDLK_f: chip8->keypad[0xE] = true; break;
+	uint64_t generator = seed;
+	uint64_t faults[FAULT_COUNT] = {0}, insts = 0;
 
-					case SDLK_w: chip8->keypad[0xA] = true; break;
-					case SDLK_x: chip8->keypad[0x0] = true; break;
-					case SDLK_c: chip8->keypad[0xB] = true; break;
-					case SDLK_v: chip8->keypad[0xF] = true; break;
+	for(uint32_t p = 0; p < programs; p++){
+		const uint64_t program_seed = validator_random(&generator);
+		validator.random = program_seed;
+		fuzz_program(&validator, program, sizeof program);
 
-					default : break;
+		rom_t rom = {.name = "fuzz", .data = program, .size = sizeof program};
+		memset(ram, 0, sizeof ram);
+		memcpy(&ram[0x200], program, sizeof program);
+		analyze_rom(&rom.metadata, ram);
+		config_t config;
+		if(!set_config_from_args(&config, &rom.metadata, argc, argv) ||
+		   !validator_init(&validator, config, &rom, block, program_seed)) return false;
+
+		for(uint32_t frame = 0; frame < frames && validator.reference.state == RUNNING && !validator.fault; frame++){
+			if(validator_frame(&validator)) continue;
+
+			validator_report_divergence(&validator);
+			FILE *file = fopen("chip8_fuzz_failure.ch8", "wb");
+			if(file){
+				fwrite(program, 1, sizeof program, file);
+				fclose(file);
+			}
+			printf("Program %u saved in chip8_fuzz_failure.ch8, replay with : chip8 --validate chip8_fuzz_failure.ch8 --quirks %s --block %u --seed %llu\n",
+				   p, validator.quirks->name, block, (unsigned long long)program_seed);
+			return false;
+		}
+		faults[validator.fault]++;
+		insts += validator.insts;
+	}
+
+	printf("%u programs, %llu instructions (block of %u, seed %llu) : no divergence\n",
+		   programs, (unsigned long long)insts, block, (unsigned long long)seed);
+	for(uint8_t f = FAULT_PC; f < FAULT_COUNT; f++)
+		printf("  %llu programs ended on %s\n", (unsigned long long)faults[f], fault_names[f]);
+	return true;
+}
+
+// Gameplay recording
+// The CHIP8 display is recorded once per 60 Hz frame, with the sound timer state (audio gate).
+// The emulator thread only packs the display into a free slot of a preallocated pool, a writer
+// thread turns it into an XOR delta against the previous frame, run length encoded. Every
+// RECORDING_KEYFRAME_INTERVAL frames a full frame is stored and indexed at the end of the file, so
+// the exporter can start anywhere. Use "chip8 --export-recording <file> <output>" to get PNG files
+// or raw video.
+#define RECORDING_MAGIC 0x43523843  // "C8RC"
+#define RECORDING_VERSION 1
+#define RECORDING_POOL_SIZE 64  // Frames, must be a power of 2
+#define RECORDING_KEYFRAME_INTERVAL 300
+#define RECORDING_FRAME_BYTES (128*64/8)
+#define RECORDING_KEYFRAME 0x01
+#define RECORDING_AUDIO 0x02
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t keyframe_interval;
+	uint32_t fg_color;
+	uint32_t bg_color;
+	uint16_t width;           // Output resolution, the biggest one : 64x32 frames are stretched
+	uint16_t height;
+	uint16_t square_wave_freq;
+	uint16_t reserved;
+	uint32_t frame_count;     // Values below are filled when the recording is closed
+	uint32_t keyframe_count;
+	uint64_t index_offset;    // 0 if the recording was not closed, frames are then read in sequence
+} recording_header_t;
+
+typedef struct {
+	uint32_t frame;  // 60 Hz frames since the start, missing numbers repeat the previous frame
+	uint16_t size;   // RLE bytes following
+	uint8_t width;
+	uint8_t height;
+	uint8_t flags;
+	uint8_t reserved[3];
+} recording_frame_t;
+
+typedef struct {
+	uint32_t frame;
+	uint32_t reserved;
+	uint64_t offset;
+} recording_index_t;
+
+typedef struct {
+	uint32_t frame;
+	uint8_t width;
+	uint8_t height;
+	bool audio;
+	uint8_t pixels[RECORDING_FRAME_BYTES];  // See pack_display
+} recording_slot_t;
+
+typedef struct {
+	recording_slot_t *pool;
+	atomic_size_t head;  // Written by the emulator thread only
+	atomic_size_t tail;  // Written by the writer thread only
+	atomic_bool stop;
+	uint64_t first_frame;
+	bool started;
+	uint64_t dropped;
+	recording_header_t header;
+	recording_index_t *index;  // Owned by the writer thread until it is stopped
+	FILE *file;
+	SDL_Thread *writer;
+} recording_t;
+
+// Runs of zero bytes (control < 0x80, 1 to 128 bytes) and literals (control >= 0x80, 1 to 128 bytes)
+uint16_t rle_encode(const uint8_t *data, const uint16_t size, uint8_t *out){
+	uint16_t in = 0, pos = 0;
+	while(in < size){
+		uint16_t run = 0;
+		while(in + run < size && data[in + run] == 0 && run < 128) run++;
+		if(run){
+			out[pos++] = run - 1;
+			in += run;
+			continue;
+		}
+
+		// Literal up to the next pair of zero bytes, a single zero is cheaper inside the literal
+		uint16_t len = 0;
+		while(in + len < size && len < 128 &&
+			  !(data[in + len] == 0 && (in + len + 1 == size || data[in + len + 1] == 0)))
+			len++;
+		out[pos++] = 0x80 + len - 1;
+		memcpy(&out[pos], &data[in], len);
+		pos += len;
+		in += len;
+	}
+	return pos;
+}
+
+bool rle_decode(const uint8_t *data, const uint16_t size, uint8_t *out, const uint16_t out_size){
+	uint16_t in = 0, pos = 0;
+	while(in < size){
+		const uint8_t control = data[in++];
+		const uint16_t len = (control & 0x7F) + 1;
+		if(pos + len > out_size || (control >= 0x80 && in + len > size)) return false;
+		if(control < 0x80){
+			memset(&out[pos], 0, len);
+		} else {
+			memcpy(&out[pos], &data[in], len);
+			in += len;
+		}
+		pos += len;
+	}
+	return pos == out_size;
+}
+
+int recording_writer_thread(void *data){
+	recording_t *recording = (recording_t *)data;
+	uint8_t previous[RECORDING_FRAME_BYTES] = {0};
+	uint8_t delta[RECORDING_FRAME_BYTES];
+	uint8_t encoded[RECORDING_FRAME_BYTES + RECORDING_FRAME_BYTES / 128];
+	uint32_t index_capacity = 0;
+
+	for(;;){
+		const bool stop = atomic_load_explicit(&recording->stop, memory_order_acquire);
+		const size_t head = atomic_load_explicit(&recording->head, memory_order_acquire);
+		const size_t tail = atomic_load_explicit(&recording->tail, memory_order_relaxed);
+
+		if(head == tail){
+			if(stop) break;
+			SDL_Delay(1);
+			continue;
+		}
+
+		const recording_slot_t *slot = &recording->pool[tail & (RECORDING_POOL_SIZE - 1)];
+		recording_header_t *header = &recording->header;
+		const bool keyframe = header->frame_count % RECORDING_KEYFRAME_INTERVAL == 0;
+
+		if(keyframe){
+			if(header->keyframe_count == index_capacity){
+				index_capacity = index_capacity ? index_capacity * 2 : 64;
+				recording_index_t *index = realloc(recording->index, index_capacity * sizeof(recording_index_t));
+				if(!index){
+					SDL_Log("Could not grow the recording index, the recording will not be seekable\n");
+					index_capacity = 0;
+				} else {
+					recording->index = index;
 				}
-				break;
-			case SDL_KEYUP:
-				switch (event.key.keysym.sym){
-					case SDLK_1: chip8->keypad[0x1] = false; break;
-					case SDLK_2: chip8->keypad[0x2] = false; break;
-					case SDLK_3: chip8->keypad[0x3] = false; break;
-					case SDLK_4: chip8->keypad[0xC] = false; break;
+			}
+			if(index_capacity)
+				recording->index[header->keyframe_count++] = (recording_index_t){
+					.frame = slot->frame,
+					.offset = (uint64_t)ftell(recording->file),
+				};
+		}
+
+		for(uint16_t i = 0; i < RECORDING_FRAME_BYTES; i++)
+			delta[i] = keyframe ? slot->pixels[i] : slot->pixels[i] ^ previous[i];
+		memcpy(previous, slot->pixels, sizeof previous);
+
+		const recording_frame_t frame = {
+			.frame = slot->frame,
+			.size = rle_encode(delta, RECORDING_FRAME_BYTES, encoded),
+			.width = slot->width,
+			.height = slot->height,
+			.flags = (keyframe ? RECORDING_KEYFRAME : 0) | (slot->audio ? RECORDING_AUDIO : 0),
+		};
+		fwrite(&frame, sizeof frame, 1, recording->file);
+		fwrite(encoded, 1, frame.size, recording->file);
+		header->frame_count++;
+
+		atomic_store_explicit(&recording->tail, tail + 1, memory_order_release);
+	}
+	return 0;
+}
+
+bool recording_open(recording_t *recording, const char *path, const config_t config){
+	memset(recording, 0, sizeof(recording_t));
+
+	recording->file = fopen(path, "wb");
+	if(!recording->file){
+		SDL_Log("Could not open recording file %s\n", path);
+		return false;
+	}
+
+	recording->header = (recording_header_t){
+		.magic = RECORDING_MAGIC,
+		.version = RECORDING_VERSION,
+		.keyframe_interval = RECORDING_KEYFRAME_INTERVAL,
+		.fg_color = config.fg_color,
+		.bg_color = config.bg_color,
+		.width = 128,
+		.height = 64,
+		.square_wave_freq = config.square_wave_freq,
+	};
+	fwrite(&recording->header, sizeof recording->header, 1, recording->file);
+
+	recording->pool = malloc(RECORDING_POOL_SIZE * sizeof(recording_slot_t));
+	if(!recording->pool){
+		SDL_Log("Could not allocate recording buffers\n");
+		fclose(recording->file);
+		return false;
+	}
+
+	recording->writer = SDL_CreateThread(recording_writer_thread, "recording_writer", recording);
+	if(!recording->writer){
+		SDL_Log("Could not create recording writer thread %s\n", SDL_GetError());
+		free(recording->pool);
+		fclose(recording->file);
+		return false;
+	}
+	return true;
+}
+
+void recording_close(recording_t *recording){
+	if(!recording->file) return;
+
+	atomic_store_explicit(&recording->stop, true, memory_order_release);
+	SDL_WaitThread(recording->writer, NULL);
+
+	// Index at the end, then the header again with the totals
+	recording->header.index_offset = (uint64_t)ftell(recording->file);
+	if(recording->header.keyframe_count)
+		fwrite(recording->index, sizeof(recording_index_t), recording->header.keyframe_count, recording->file);
+	fseek(recording->file, 0, SEEK_SET);
+	fwrite(&recording->header, sizeof recording->header, 1, recording->file);
+	fclose(recording->file);
+	free(recording->index);
+	free(recording->pool);
+
+	if(recording->dropped)
+		SDL_Log("Recording writer could not keep up, %llu frames dropped\n", (unsigned long long)recording->dropped);
+	recording->file = NULL;
+}
+
+// One bit per pixel, MSB first, size bytes
+void pack_display(const bool display[128*64], uint8_t bits[RECORDING_FRAME_BYTES], const uint16_t size){
+	for(uint16_t i = 0; i < size; i++){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		// 8 bools (0 or 1 bytes) at once, the multiply gathers byte n into bit 7 - n of the top byte
+		uint64_t pixels;
+		memcpy(&pixels, &display[i * 8], sizeof pixels);
+		bits[i] = (pixels * 0x8040201008040201) >> 56;
+#else
+		const bool *pixels = &display[i * 8];
+		bits[i] = pixels[0] << 7 | pixels[1] << 6 | pixels[2] << 5 | pixels[3] << 4 |
+				  pixels[4] << 3 | pixels[5] << 2 | pixels[6] << 1 | pixels[7];
+#endif
+	}
+}
+
+// Queue the current display, never waits : the frame is dropped if the pool is full
+void recording_capture(recording_t *recording, const chip8_t *chip8, const uint64_t frame){
+	const size_t head = atomic_load_explicit(&recording->head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&recording->tail, memory_order_acquire);
+
+	if(!recording->started){
+		recording->first_frame = frame;
+		recording->started = true;
+	}
+	if(head - tail >= RECORDING_POOL_SIZE){
+		recording->dropped++;
+		return;
+	}
+
+	recording_slot_t *slot = &recording->pool[head & (RECORDING_POOL_SIZE - 1)];
+	slot->frame = frame - recording->first_frame;
+	slot->width = chip8->width;
+	slot->height = chip8->height;
+	slot->audio = chip8->sound_timer > 0;
+	pack_display(chip8->display, slot->pixels, RECORDING_FRAME_BYTES);
+
+	atomic_store_explicit(&recording->head, head + 1, memory_order_release);
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, const size_t size){
+	static uint32_t table[256];
+	if(!table[1]){
+		for(uint32_t n = 0; n < 256; n++){
+			uint32_t c = n;
+			for(uint8_t k = 0; k < 8; k++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	}
+	crc = ~crc;
+	for(size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+void write_be32(uint8_t *out, const uint32_t value){
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+void png_chunk(FILE *file, const char *type, const uint8_t *data, const uint32_t size){
+	uint8_t bytes[4];
+	write_be32(bytes, size);
+	fwrite(bytes, 1, 4, file);
+	fwrite(type, 1, 4, file);
+	fwrite(data, 1, size, file);
+	write_be32(bytes, crc32_update(crc32_update(0, (const uint8_t *)type, 4), data, size));
+	fwrite(bytes, 1, 4, file);
+}
+
+// 8 bit RGB PNG, the zlib stream uses stored blocks : frames are tiny and this needs no deflate
+bool write_png(const char *path, const uint8_t *rgb, const uint32_t width, const uint32_t height){
+	FILE *file = fopen(path, "wb");
+	if(!file){
+		SDL_Log("Could not open %s\n", path);
+		return false;
+	}
+
+	const uint32_t raw_size = height * (1 + width * 3);
+	const uint32_t blocks = (raw_size + 0xFFFF - 1) / 0xFFFF;
+	uint8_t *idat = malloc(2 + raw_size + blocks * 5 + 4);
+	uint8_t *raw = malloc(raw_size);
+	if(!idat || !raw){
+		free(idat);
+		free(raw);
+		fclose(file);
+		return false;
+	}
+	for(uint32_t y = 0; y < height; y++){
+		raw[y * (1 + width * 3)] = 0;  // No filter
+		memcpy(&raw[y * (1 + width * 3) + 1], &rgb[y * width * 3], width * 3);
+	}
+
+	uint32_t pos = 0, a = 1, b = 0;
+	idat[pos++] = 0x78;
+	idat[pos++] = 0x01;
+	for(uint32_t offset = 0; offset < raw_size; offset += 0xFFFF){
+		const uint16_t len = raw_size - offset < 0xFFFF ? raw_size - offset : 0xFFFF;
+		const uint16_t nlen = ~len;
+		idat[pos++] = offset + len == raw_size;  // Last block
+		idat[pos++] = len & 0xFF;
+		idat[pos++] = len >> 8;
+		idat[pos++] = nlen & 0xFF;
+		idat[pos++] = nlen >> 8;
+		memcpy(&idat[pos], &raw[offset], len);
+		pos += len;
+	}
+	for(uint32_t i = 0; i < raw_size; i++){
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	write_be32(&idat[pos], b << 16 | a);
+	pos += 4;
+
+	uint8_t ihdr[13] = {0};
+	write_be32(&ihdr[0], width);
+	write_be32(&ihdr[4], height);
+	ihdr[8] = 8;  // Bit depth
+	ihdr[9] = 2;  // RGB
+
+	fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+	png_chunk(file, "IHDR", ihdr, sizeof ihdr);
+	png_chunk(file, "IDAT", idat, pos);
+	png_chunk(file, "IEND", NULL, 0);
+
+	free(idat);
+	free(raw);
+	const bool ok = !ferror(file);
+	fclose(file);
+	return ok;
+}
+
+// 16 bit mono WAV, sizes are patched by wav_close
+FILE *wav_open(const char *path, const uint32_t sample_rate){
+	FILE *file = fopen(path, "wb");
+	if(!file){
+		SDL_Log("Could not open %s\n", path);
+		return NULL;
+	}
+	const uint32_t byte_rate = sample_rate * 2;
+	const uint16_t format[] = {1, 1};  // PCM, mono
+	const uint16_t layout[] = {2, 16}; // Block align, bits per sample
+	const uint32_t zero = 0, fmt_size = 16;
+	fwrite("RIFF", 1, 4, file);
+	fwrite(&zero, 4, 1, file);
+	fwrite("WAVEfmt ", 1, 8, file);
+	fwrite(&fmt_size, 4, 1, file);
+	fwrite(format, 2, 2, file);
+	fwrite(&sample_rate, 4, 1, file);
+	fwrite(&byte_rate, 4, 1, file);
+	fwrite(layout, 2, 2, file);
+	fwrite("data", 1, 4, file);
+	fwrite(&zero, 4, 1, file);
+	return file;
+}
+
+void wav_close(FILE *file){
+	const uint32_t size = (uint32_t)ftell(file);
+	const uint32_t riff_size = size - 8, data_size = size - 44;
+	fseek(file, 4, SEEK_SET);
+	fwrite(&riff_size, 4, 1, file);
+	fseek(file, 40, SEEK_SET);
+	fwrite(&data_size, 4, 1, file);
+	fclose(file);
+}
+
+typedef struct {
+	const char *output;
+	bool raw;
+	FILE *video;
+	FILE *audio;
+	uint32_t width;         // Output size, the recording resolution times scale
+	uint32_t height;
+	uint8_t *rgb;
+	uint32_t audio_phase;
+	uint64_t frames;
+} exporter_t;
+
+#define EXPORT_SAMPLE_RATE 44100
+
+// Write one 60 Hz frame, frames of another resolution are stretched to the output size
+bool export_frame(exporter_t *exporter, const recording_header_t *header, const recording_frame_t *frame,
+				  const uint8_t *pixels, const uint32_t number){
+	const uint8_t fg[3] = {header->fg_color >> 24, header->fg_color >> 16, header->fg_color >> 8};
+	const uint8_t bg[3] = {header->bg_color >> 24, header->bg_color >> 16, header->bg_color >> 8};
+
+	for(uint32_t y = 0; y < exporter->height; y++){
+		const uint32_t src_y = y * frame->height / exporter->height;
+		for(uint32_t x = 0; x < exporter->width; x++){
+			const uint32_t i = src_y * frame->width + x * frame->width / exporter->width;
+			const bool on = (pixels[i / 8] >> (7 - i % 8)) & 1;
+			memcpy(&exporter->rgb[(y * exporter->width + x) * 3], on ? fg : bg, 3);
+		}
+	}
+
+	if(exporter->raw){
+		fwrite(exporter->rgb, 3, exporter->width * exporter->height, exporter->video);
+
+		// The square wave of audio_callback, gated by the recorded sound timer
+		const uint32_t period = EXPORT_SAMPLE_RATE / header->square_wave_freq;
+		int16_t samples[EXPORT_SAMPLE_RATE / 60];
+		for(uint32_t i = 0; i < EXPORT_SAMPLE_RATE / 60; i++, exporter->audio_phase++){
+			const int16_t level = (exporter->audio_phase % period) < period / 2 ? 3000 : -3000;
+			samples[i] = frame->flags & RECORDING_AUDIO ? level : 0;
+		}
+		fwrite(samples, sizeof samples[0], EXPORT_SAMPLE_RATE / 60, exporter->audio);
+	} else {
+		char path[1024];
+		snprintf(path, sizeof path, "%s_%06u.png", exporter->output, number);
+		if(!write_png(path, exporter->rgb, exporter->width, exporter->height)) return false;
+	}
+	exporter->frames++;
+	return true;
+}
+
+// Offline exporter : PNG files <output>_NNNNNN.png, or raw RGB24 video in <output>.raw with the
+// audio in <output>.wav. Frames from and to are counted from the start of the recording.
+bool export_recording(const char *path, const char *output, const uint32_t from, const uint32_t to, const uint32_t scale){
+	FILE *file = fopen(path, "rb");
+	if(!file){
+		SDL_Log("Could not open recording file %s\n", path);
+		return false;
+	}
+
+	recording_header_t header;
+	if(fread(&header, sizeof header, 1, file) != 1 || header.magic != RECORDING_MAGIC ||
+	   header.version != RECORDING_VERSION || !header.width || !header.height || !header.square_wave_freq){
+		SDL_Log("Recording file %s is invalid or from another version\n", path);
+		fclose(file);
+		return false;
+	}
+
+	// Start from the last keyframe before the first frame wanted
+	long start = sizeof header;
+	if(header.index_offset && header.keyframe_count && fseek(file, header.index_offset, SEEK_SET) == 0){
+		recording_index_t entry;
+		for(uint32_t i = 0; i < header.keyframe_count && fread(&entry, sizeof entry, 1, file) == 1; i++){
+			if(entry.frame > from) break;
+			start = entry.offset;
+		}
+	} else {
+		SDL_Log("Recording %s has no index (not closed properly ?), reading it from the start\n", path);
+	}
+	fseek(file, start, SEEK_SET);
+
+	exporter_t exporter = {
+		.output = output,
+		.raw = strlen(output) > 4 && strcmp(output + strlen(output) - 4, ".raw") == 0,
+		.width = header.width * scale,
+		.height = header.height * scale,
+	};
+	exporter.rgb = malloc(exporter.width * exporter.height * 3);
+	if(exporter.raw){
+		char audio_path[1024];
+		snprintf(audio_path, sizeof audio_path, "%.*s.wav", (int)strlen(output) - 4, output);
+		exporter.video = fopen(output, "wb");
+		exporter.audio = wav_open(audio_path, EXPORT_SAMPLE_RATE);
+	}
+	if(!exporter.rgb || (exporter.raw && (!exporter.video || !exporter.audio))){
+		SDL_Log("Could not open the export output %s\n", output);
+		free(exporter.rgb);
+		if(exporter.video) fclose(exporter.video);
+		if(exporter.audio) fclose(exporter.audio);
+		fclose(file);
+		return false;
+	}
+
+	uint8_t pixels[RECORDING_FRAME_BYTES] = {0};
+	uint8_t delta[RECORDING_FRAME_BYTES];
+	uint8_t encoded[RECORDING_FRAME_BYTES + RECORDING_FRAME_BYTES / 128];
+	recording_frame_t frame, previous = {0};
+	bool has_previous = false, ok = true;
+	uint32_t next = from;  // Next frame number to output
+
+	const long end = header.index_offset ? (long)header.index_offset : -1;
+	while(ok && next <= to && (end < 0 || ftell(file) < end) && fread(&frame, sizeof frame, 1, file) == 1){
+		if(frame.size > sizeof encoded || fread(encoded, 1, frame.size, file) != frame.size ||
+		   !rle_decode(encoded, frame.size, delta, RECORDING_FRAME_BYTES) ||
+		   frame.width * frame.height > RECORDING_FRAME_BYTES * 8 || !frame.width || !frame.height){
+			SDL_Log("Recording %s is corrupted at frame %u\n", path, frame.frame);
+			break;
+		}
+
+		// Frames that were not recorded repeat the previous one
+		while(ok && has_previous && next < frame.frame && next <= to)
+			ok = export_frame(&exporter, &header, &previous, pixels, next++);
+
+		for(uint16_t i = 0; i < RECORDING_FRAME_BYTES; i++)
+			pixels[i] = frame.flags & RECORDING_KEYFRAME ? delta[i] : pixels[i] ^ delta[i];
+		previous = frame;
+		has_previous = true;
+
+		if(ok && frame.frame >= next && frame.frame <= to){
+			next = frame.frame;
+			ok = export_frame(&exporter, &header, &frame, pixels, next++);
+		}
+	}
+
+	if(exporter.raw){
+		fclose(exporter.video);
+		wav_close(exporter.audio);
+		if(ok) printf("%llu frames, play with : ffplay -f rawvideo -pixel_format rgb24 -video_size %ux%u -framerate 60 %s\n",
+					  (unsigned long long)exporter.frames, exporter.width, exporter.height, output);
+	} else if(ok){
+		printf("%llu frames written to %s_NNNNNN.png\n", (unsigned long long)exporter.frames, output);
+	}
+	free(exporter.rgb);
+	fclose(file);
+	return ok;
+}
+
+// Session server
+// chip8 --serve <socket> runs many CHIP8 sessions in one process, each one driven by a client
+// connected to a Unix domain socket (protocol in chip8_server.h). The main thread does all the
+// socket I/O with poll and runs a 60 Hz tick : the sessions that are not parked are shared between
+// a fixed pool of worker threads, which emulate one frame each and queue the messages to send.
+// Sessions are only touched by the main thread between ticks, so they need no locking.
+// A session is parked when a whole frame brought it back to the state it started from without drawing,
+// writing memory or touching the timers : it is looping on input (FX0A, EX9E/EXA1 polling), only a key
+// can change what it does next, it costs nothing until one comes.
+#ifndef _WIN32
+#define SERVER_MAX_OUTPUT (256 * 1024)  // Bytes queued for a client that does not read, before dropping it
+#define SERVER_MAX_IPS 1000000          // Above that, one session would hold the shared tick for everybody
+
+typedef struct {
+	int fd;
+	bool loaded;
+	bool idle;             // Set by the worker when the last frame changed nothing
+	bool closing;          // Close once the pending output is sent
+	bool audio;            // Audio gate last sent
+	int32_t active_index;  // Position in the active list, -1 when parked
+	chip8_t chip8;
+	config_t config;
+	const quirk_profile_t *quirks;
+	rom_t rom;
+	uint8_t rom_data[4096 - 0x200];
+	uint32_t inst_remainder;  // Instructions per second not emulated yet, carried to the next frame
+	uint32_t frame_insts;     // Instructions emulated by the last tick
+	uint64_t load_tick;
+	uint8_t sent[RECORDING_FRAME_BYTES];  // Display as the client knows it
+	uint8_t in[CHIP8_SERVER_HEADER_SIZE + CHIP8_SERVER_MAX_PAYLOAD];
+	uint32_t in_size;
+	uint8_t *out;
+	uint32_t out_size;
+	uint32_t out_capacity;
+} session_t;
+
+typedef struct {
+	int listen_fd;
+	session_t **sessions;
+	struct pollfd *fds;       // fds[0] is the listening socket, fds[i + 1] belongs to sessions[i]
+	uint32_t count;
+	uint32_t max_sessions;
+	session_t **active;       // Sessions emulated at the next tick
+	uint32_t active_count;
+	uint64_t tick;
+	uint64_t late_ticks;
+	SDL_Thread **workers;
+	uint32_t worker_count;
+	SDL_mutex *lock;
+	SDL_cond *start;
+	SDL_cond *done;
+	uint64_t generation;      // Bumped for every tick
+	uint32_t running;         // Workers still busy with the current tick
+	atomic_uint next;         // Next index in active to emulate
+	bool stop;
+	bool bound;               // The socket path is ours to remove
+	metrics_t metrics;        // One block for the whole server, totals over every session
+	uint64_t insts;
+	uint64_t session_frames;
+	uint64_t draws;
+	uint64_t sleep_ticks;     // Time spent in poll
+	uint64_t ips_tick;        // Instructions per second are measured over 60 ticks
+	uint64_t ips_insts;
+	uint32_t ips;
+} server_t;
+
+volatile sig_atomic_t server_quit;
+
+void server_signal(int signal_number){
+	(void)signal_number;
+	server_quit = 1;
+}
+
+void write_le32(uint8_t *out, const uint32_t value){
+	out[0] = value;
+	out[1] = value >> 8;
+	out[2] = value >> 16;
+	out[3] = value >> 24;
+}
+
+uint32_t read_le32(const uint8_t *in){
+	return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+// Queue a message for the client, a client that stopped reading is dropped
+void session_send(session_t *session, const uint8_t type, const uint8_t *payload, const uint16_t size){
+	const uint32_t needed = session->out_size + CHIP8_SERVER_HEADER_SIZE + size;
+	if(needed > SERVER_MAX_OUTPUT){
+		session->closing = true;
+		session->out_size = 0;
+		return;
+	}
+	if(needed > session->out_capacity){
+		uint32_t capacity = session->out_capacity ? session->out_capacity : 4096;
+		while(capacity < needed) capacity *= 2;
+		uint8_t *out = realloc(session->out, capacity);
+		if(!out){
+			session->closing = true;
+			session->out_size = 0;
+			return;
+		}
+		session->out = out;
+		session->out_capacity = capacity;
+	}
+
+	uint8_t *message = &session->out[session->out_size];
+	message[0] = type;
+	message[1] = 0;
+	message[2] = size & 0xFF;
+	message[3] = size >> 8;
+	memcpy(&message[CHIP8_SERVER_HEADER_SIZE], payload, size);
+	session->out_size = needed;
+}
+
+void session_error(session_t *session, const char *text){
+	session_send(session, CHIP8_MSG_ERROR, (const uint8_t *)text, strlen(text));
+	session->closing = true;
+}
+
+// Emulate one 60 Hz frame, runs on a worker thread
+void session_tick(session_t *session, const uint64_t tick){
+	chip8_t *chip8 = &session->chip8;
+	const uint16_t PC = chip8->PC;
+	const uint16_t I = chip8->I;
+	const uint16_t *stack_ptr = chip8->stack_ptr;
+	const uint32_t random = chip8->random;
+	const uint32_t width = chip8->width;
+	const bool timers_running = chip8->delay_timer || chip8->sound_timer;
+	uint8_t V[16];
+	uint16_t stack[sizeof chip8->stack / sizeof chip8->stack[0]];
+	memcpy(V, chip8->V, sizeof V);
+	memcpy(stack, chip8->stack, sizeof stack);
+
+	session->inst_remainder += session->config.insts_per_second;
+	const uint32_t insts = session->inst_remainder / 60;
+	session->inst_remainder %= 60;
+	chip8->draws = 0;
+	chip8->stores = 0;
+	session->quirks->emulate_instructions(chip8, session->config, insts);
+	session->frame_insts = insts;
+	if(chip8->delay_timer > 0) chip8->delay_timer--;
+	if(chip8->sound_timer > 0) chip8->sound_timer--;
+	if(chip8->state == QUIT) session->closing = true;  // 00FD
+
+	uint8_t payload[6 + RECORDING_FRAME_BYTES + RECORDING_FRAME_BYTES / 128];
+	write_le32(payload, tick - session->load_tick);
+
+	// Pixels past the resolution are never drawn, their bits stay 0
+	const uint16_t used = chip8->width * chip8->height / 8;
+	uint8_t bits[RECORDING_FRAME_BYTES], delta[RECORDING_FRAME_BYTES] = {0};
+	uint8_t changed = 0;
+	pack_display(chip8->display, bits, used);
+	for(uint16_t i = 0; i < used; i++){
+		delta[i] = bits[i] ^ session->sent[i];
+		changed |= delta[i];
+	}
+	if(changed){
+		memcpy(session->sent, bits, used);
+		payload[4] = chip8->width;
+		payload[5] = chip8->height;
+		session_send(session, CHIP8_MSG_FRAME, payload, 6 + rle_encode(delta, RECORDING_FRAME_BYTES, &payload[6]));
+	}
+
+	const bool audio = chip8->sound_timer > 0;
+	if(audio != session->audio){
+		session->audio = audio;
+		payload[4] = audio;
+		session_send(session, CHIP8_MSG_AUDIO, payload, 5);
+	}
+
+	// The whole machine is back where it started : the frame ran whole turns of a loop, which will
+	// repeat the same way until the keys change. Memory and timers are covered by the store count.
+	// A frame that ran no instruction proves nothing, below 60 per second most frames run none.
+	session->idle = insts && !timers_running && !audio && !chip8->draws && !chip8->stores && !changed &&
+					chip8->PC == PC && chip8->I == I && chip8->random == random && chip8->width == width &&
+					chip8->stack_ptr == stack_ptr && memcmp(stack, chip8->stack, sizeof stack) == 0 &&
+					memcmp(V, chip8->V, sizeof V) == 0;
+}
+
+int server_worker_thread(void *data){
+	server_t *server = (server_t *)data;
+	uint64_t seen = 0;
+
+	SDL_LockMutex(server->lock);
+	for(;;){
+		while(server->generation == seen && !server->stop)
+			SDL_CondWait(server->start, server->lock);
+		if(server->stop) break;
+		seen = server->generation;
+		SDL_UnlockMutex(server->lock);
+
+		for(uint32_t i = atomic_fetch_add(&server->next, 1); i < server->active_count; i = atomic_fetch_add(&server->next, 1))
+			session_tick(server->active[i], server->tick);
+
+		SDL_LockMutex(server->lock);
+		if(--server->running == 0) SDL_CondSignal(server->done);
+	}
+	SDL_UnlockMutex(server->lock);
+	return 0;
+}
+
+void server_activate(server_t *server, session_t *session){
+	if(session->active_index >= 0 || !session->loaded || session->closing) return;
+	session->active_index = server->active_count;
+	server->active[server->active_count++] = session;
+}
+
+void server_park(server_t *server, session_t *session){
+	if(session->active_index < 0) return;
+	session_t *last = server->active[--server->active_count];
+	server->active[session->active_index] = last;
+	last->active_index = session->active_index;
+	session->active_index = -1;
+}
+
+// Emulate one frame of every active session on the worker pool, then park the idle ones
+void server_tick(server_t *server){
+	if(!server->active_count) return;
+
+	SDL_LockMutex(server->lock);
+	atomic_store(&server->next, 0);
+	server->running = server->worker_count;
+	server->generation++;
+	SDL_CondBroadcast(server->start);
+	while(server->running)
+		SDL_CondWait(server->done, server->lock);
+	SDL_UnlockMutex(server->lock);
+
+	for(uint32_t i = server->active_count; i-- > 0;){
+		session_t *session = server->active[i];
+		server->insts += session->frame_insts;
+		server->draws += session->chip8.draws;
+		server->session_frames++;
+		if(session->idle || session->closing) server_park(server, session);
+	}
+}
+
+void server_metrics_update(server_t *server){
+	chip8_metrics_t *shared = server->metrics.shared;
+	if(!shared) return;
+
+	if(server->tick >= server->ips_tick + 60){
+		server->ips = (server->insts - server->ips_insts) * 60 / (server->tick - server->ips_tick);
+		server->ips_tick = server->tick;
+		server->ips_insts = server->insts;
+	}
+	atomic_store_explicit(&shared->update_ms, wall_clock_ms(), memory_order_relaxed);
+	atomic_store_explicit(&shared->state, RUNNING, memory_order_relaxed);
+	atomic_store_explicit(&shared->sessions, server->count, memory_order_relaxed);
+	atomic_store_explicit(&shared->insts_per_second, server->ips, memory_order_relaxed);
+	atomic_store_explicit(&shared->insts, server->insts, memory_order_relaxed);
+	atomic_store_explicit(&shared->frames_emulated, server->session_frames, memory_order_relaxed);
+	atomic_store_explicit(&shared->frames_presented, server->tick, memory_order_relaxed);
+	atomic_store_explicit(&shared->late_frames, server->late_ticks, memory_order_relaxed);
+	atomic_store_explicit(&shared->sleep_us, server->sleep_ticks * 1000000 / SDL_GetPerformanceFrequency(), memory_order_relaxed);
+	atomic_store_explicit(&shared->draws, server->draws, memory_order_relaxed);
+}
 
-					case SDLK_a: chip8->keypad[0x4] = false; break;
-					case SDLK_z: chip8->keypad[0x5] = false; break;
-					case SDLK_e: chip8->keypad[0x6] = false; break;
-					case SDLK_r: chip8->keypad[0xD] = false; break;
+void session_load(server_t *server, session_t *session, const uint8_t *payload, const uint16_t size){
+	if(size < 8 || size > 8 + sizeof session->rom_data || (payload[0] >= QUIRKS_COUNT && payload[0] != 0xFF)){
+		session_error(session, "Invalid LOAD message");
+		return;
+	}
+	if(read_le32(&payload[4]) > SERVER_MAX_IPS){
+		session_error(session, "Instructions per second out of range");
+		return;
+	}
 
-					case SDLK_q: chip8->keypad[0x7] = false; break;
-					case SDLK_s: chip8->keypad[0x8] = false; break;
-					case SDLK_d: chip8->keypad[0x9] = false; break;
-					case SDLK_f: chip8->keypad[0xE] = false; break;
+	// Same defaults as a ROM launched for the first time, the client can override them
+	memcpy(session->rom_data, &payload[8], size - 8);
+	session->rom = (rom_t){.name = "client", .data = session->rom_data, .size = size - 8};
+	static uint8_t ram[4096];
+	memset(ram, 0, sizeof ram);
+	memcpy(&ram[0x200], session->rom_data, session->rom.size);
+	analyze_rom(&session->rom.metadata, ram);
+	session->rom.metadata.hash = hash_rom(session->rom.data, session->rom.size);
+	if(payload[0] != 0xFF) session->rom.metadata.quirks = payload[0];
+	if(read_le32(&payload[4])) session->rom.metadata.insts_per_second = read_le32(&payload[4]);
 
-					case SDLK_w: chip8->keypad[0xA] = false; break;
-					case SDLK_x: chip8->keypad[0x0] = false; break;
-					case SDLK_c: chip8->keypad[0xB] = false; break;
-					case SDLK_v: chip8->keypad[0xF] = false; break;
+	set_config_from_args(&session->config, &session->rom.metadata, 0, NULL);
+	session->quirks = &quirk_profiles[session->config.quirks];
+	init_chip8(&session->chip8, session->config, &session->rom);
+	session->chip8.random = (uint32_t)session->rom.metadata.hash;
+	session->inst_remainder = 0;
+	session->load_tick = server->tick;
+	memset(session->sent, 0, sizeof session->sent);  // Deltas start over from a blank display
+	session->audio = false;
+	session->loaded = true;
+	server_activate(server, session);
+}
 
-					default : break;
+// Read what the client sent and handle every complete message
+void session_read(server_t *server, session_t *session){
+	const ssize_t received = recv(session->fd, &session->in[session->in_size], sizeof session->in - session->in_size, 0);
+	if(received <= 0){
+		if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+		session->closing = true;  // Client gone, nothing left to send
+		session->out_size = 0;
+		return;
+	}
+	session->in_size += received;
+
+	uint32_t pos = 0;
+	while(session->in_size - pos >= CHIP8_SERVER_HEADER_SIZE && !session->closing){
+		const uint8_t *message = &session->in[pos];
+		const uint16_t size = message[2] | message[3] << 8;
+		if(size > CHIP8_SERVER_MAX_PAYLOAD){
+			session_error(session, "Message too big");
+			break;
+		}
+		if(session->in_size - pos < (uint32_t)CHIP8_SERVER_HEADER_SIZE + size) break;
+
+		const uint8_t *payload = &message[CHIP8_SERVER_HEADER_SIZE];
+		switch(message[0]){
+			case CHIP8_MSG_LOAD:
+				session_load(server, session, payload, size);
+				break;
+			case CHIP8_MSG_KEYPAD:
+				if(size != 2){
+					session_error(session, "Invalid KEYPAD message");
+					break;
 				}
+				for(uint8_t i = 0; i < 16; i++)
+					session->chip8.keypad[i] = ((payload[0] | payload[1] << 8) >> i) & 1;
+				server_activate(server, session);
 				break;
 			default:
+				session_error(session, "Unknown message type");
 				break;
 		}
+		pos += CHIP8_SERVER_HEADER_SIZE + size;
 	}
+	memmove(session->in, &session->in[pos], session->in_size - pos);
+	session->in_size -= pos;
 }
 
-#ifdef DEBUG
-	void print_debug_info(chip8_t *chip8){
-		printf("Adress : 0x%04X, Opcode : 0x%04X Desc : ", chip8->PC-2, chip8->inst.opcode);
-		switch ((chip8->inst.opcode >> 12) & 0x0F){
-			case 0x00:
-				if(chip8->inst.NN == 0xE0){
-					printf("Clear screen\n");
-				} else if(chip8->inst.NN == 0xEE){
-					printf("Return from subroutine to adress 0x%04X\n", *(chip8->stack_ptr - 1));
-				} else if(chip8->inst.N2 == 0x0C0){
-					printf("Scroll down the whole screen of %u \n", chip8->inst.N);
-				} else if(chip8->inst.NN == 0xFB) {
-					printf("Scroll right the whole screen of 4px \n");
-				} else if(chip8->inst.NN == 0xFC) {
-					printf("Scroll left the whole screen of 4px \n");
-				} else if(chip8->inst.NN == 0xFE) {
-					printf("Disable high resolution graphics mode and return to 64x32 \n");
-				} else if(chip8->inst.NN == 0xFF) {
-					printf("Enable 128x64 high resolution graphics mode \n");
-				} else if(chip8->inst.NN == 0xFD) {
-					printf("Exit the Chip8/SuperChip interpreter \n");
-				} else {
-					printf("Unimplemented Opcode.\n");
-				}
-				break;
-			case 0x01:
-				printf("Jump to address NNN (0x%04X)\n", chip8->inst.NNN);
-				break;
-			case 0x02:
-				printf("Call subroutine at NNN (0x%04X)\n", chip8->inst.NNN);
-				break;
-			case 0x03:
-				printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",
-						chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-				break;
-			case 0x04:
-				printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",
-						chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-				break;
-			case 0x05:
-				printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
-						chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-				break;
-			case 0x06:
-				printf("Set register V%X = NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
-				break;
-			case 0x07:
-				printf("Set register V%X (0x%02X) += NN (0x%02X). Result 0x%02X\n", 
-						chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->V[chip8->inst.X] + chip8->inst.NN);
-			case 0x08:
-				switch (chip8->inst.N){
-					case 0:
-						printf("Set register V%X = V%X (0x%02X)\n", 
-								chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y]);
-						break;
-					case 1:
-						printf("Set register V%X (0x%02X) |= V%X (0x%02X). Result : 0x%02X\n", 
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-								chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
-						break;
-					case 2:
-						printf("Set register V%X (0x%02X) &= V%X (0x%02X). Result : 0x%02X\n", 
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-								chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
-						break;
-					case 3:
-						printf("Set register V%X (0x%02X) ^= V%X (0x%02X). Result : 0x%02X\n", 
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-								chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
-						break;
-					case 4:
-						printf("Set register V%X (0x%02X) += V%X (0x%02X), VF = 1 if carry. Result : 0x%02X, VF = %X\n", 
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-								chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y],
-								((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255));
-						break;
-					case 5:
-						printf("Set register V%X (0x%02X) -= V%X (0x%02X), VF = 1 if no borrow. Result : 0x%02X, VF = %X\n", 
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-								chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y],
-								(chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]));
-						break;
-					case 6:
-						printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X). Result : 0x%02X, VF = %X\n", 
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] & 1,
-								chip8->V[chip8->inst.X] >> 1);
-						break;
-					case 7:
-						printf("Set register V%X = V%X (0x%02X) - V%X (0x%02X), VF = 1 if no borrow. Result : 0x%02X, VF = %X\n", 
-								chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y], 
-								chip8->inst.X, chip8->V[chip8->inst.X],
-								chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X],
-								(chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
-						break;
-					case 0xE:
-						printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X). Result : 0x%02X, VF = %X\n", 
-								chip8->inst.X, chip8->V[chip8->inst.X], (chip8->V[chip8->inst.X] & 0x80) >> 7,
-								chip8->V[chip8->inst.X] << 1);
-						break;
-					default:
-						printf("Unimplemented Opcode.\n");
-						break;
-				}
-				break;
-			case 0x09:
-				printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n",
-						chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-				break;
-			case 0x0A:
-				printf("Set I to NNN (0x%04X)\n", chip8->inst.NNN);
-				break;
-			case 0x0B:
-				printf("Set PC to V0 (0x%02X) + NNN (0x%04X). Result PC = 0x%04X\n", 
-						chip8->V[0], chip8->inst.NNN, chip8->V[0] + chip8->inst.NNN);
-				break;
-			case 0x0C:
-				printf("Set V%X = rand() %% 256 & NN (0x%02X)\n", chip8->V[chip8->inst.X], chip8->inst.NN);
-				break;
-			case 0x0D:
-				printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) "
-						"from memory location I (0x%04X). Set VF = 1 if any pixels are turned off.\n",
-						chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->I);
-				break;
-			case 0x0E:
-				if(chip8->inst.NN == 0x9E){
-					printf("Skip next instruction if key in V%X (0x%02X) is pressed. Keypad value: %d\n",
-							chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-				} else if(chip8->inst.NN == 0xA1){
-					printf("Skip next instruction if key in V%X (0x%02X) is not pressed. Keypad value: %d\n",
-							chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-				}
-				break;
-			case 0x0F:
-				switch (chip8->inst.NN) {
-					case 0x0A: {
-						printf("Await until a key is pressed. Stored key in V%X\n", chip8->inst.X);
-					}
-					case 0x1E:
-						printf("I (0x%04X) += V%X (0x%02X). Result (I) : 0x%04X\n", 
-								chip8->I, chip8->inst.X, chip8->V[chip8->inst.X],
-								chip8->I + chip8->V[chip8->inst.X]);
-						break;
-					case 0x07:
-						printf("Set V%X = delay timer value (0x%02X)\n", chip8->inst.X, chip8->delay_timer);
-						break;
-					case 0x15:
-						printf("Set delay timer value = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-						break;
-					case 0x18:
-						printf("Set sound timer value = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-						break;
-					case 0x29:
-						printf("Set I to sprite location in memory for character in V%X (0x%02X). Result(VX*5) = (0x%02X)\n",
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] * 5);
-						break;
-					case 0x30:
-						printf("Point I to 10-byte font sprite for digit V%X (only digits 0-9)", chip8->inst.X);
-						break;
-					case 0x33:
-						printf("Store BCD representation of V%X (0x%02X) at memory form I (0x%04X)\n",
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-						break;
-					case 0x55:
-						printf("Register dumb V0-V%X (0x%02X) inclusive at memory form I (0x%04X)\n",
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-						break;
-					case 0x65:
-						printf("Register load V0-V%X (0x%02X) inclusive from memory form I (0x%04X)\n",
-								chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-						break;
-					default:
-						break;
-				}
-				break;
-			default :
-				printf("Unimplemented opcode.\n");
-				break;
+void session_write(session_t *session){
+	if(!session->out_size) return;
+	const ssize_t sent = send(session->fd, session->out, session->out_size, 0);
+	if(sent < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+		session->closing = true;
+		session->out_size = 0;
+		return;
+	}
+	memmove(session->out, &session->out[sent], session->out_size - sent);
+	session->out_size -= sent;
+}
+
+void server_accept(server_t *server){
+	for(;;){
+		const int fd = accept(server->listen_fd, NULL, NULL);
+		if(fd < 0) return;
+		session_t *session = server->count < server->max_sessions ? calloc(1, sizeof(session_t)) : NULL;
+		if(!session){
+			close(fd);
+			continue;
 		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		session->fd = fd;
+		session->active_index = -1;
+		server->sessions[server->count] = session;
+		server->fds[server->count + 1] = (struct pollfd){.fd = fd, .events = POLLIN};
+		server->count++;
 	}
-#endif
+}
 
-void emulate_instruction(chip8_t *chip8, config_t config){
-	bool carry;
-	chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC+1];
-	chip8->PC += 2;
+void server_remove(server_t *server, const uint32_t index){
+	session_t *session = server->sessions[index];
+	server_park(server, session);
+	close(session->fd);
+	free(session->out);
+	free(session);
+	server->count--;
+	server->sessions[index] = server->sessions[server->count];
+	server->fds[index + 1] = server->fds[server->count + 1];
+}
 
-	chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-	chip8->inst.NN = chip8->inst.opcode & 0x0FF;
-	chip8->inst.N = chip8->inst.opcode & 0x0F;
-	chip8->inst.N2 = chip8->inst.opcode & 0x00F0;
-	chip8->inst.X = (chip8->inst.opcode >> 8) & 0x0F;
-	chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x0F;
+// A socket left behind by a server that did not exit cleanly is replaced. Anything else at the path,
+// a file or the socket of a server still running, is left alone.
+bool server_claim_path(const char *path, const struct sockaddr_un *addr){
+	struct stat st;
+	if(lstat(path, &st) != 0){
+		if(errno == ENOENT) return true;
+		SDL_Log("Could not check %s : %s\n", path, strerror(errno));
+		return false;
+	}
+	if(!S_ISSOCK(st.st_mode)){
+		SDL_Log("%s exists and is not a socket\n", path);
+		return false;
+	}
 
-#ifdef DEBUG
-	print_debug_info(chip8);
-#endif
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0){
+		SDL_Log("Could not check %s : %s\n", path, strerror(errno));
+		return false;
+	}
+	const bool connected = connect(fd, (const struct sockaddr *)addr, sizeof *addr) == 0;
+	const int error = errno;
+	close(fd);
+	if(connected){
+		SDL_Log("A server is already listening on %s\n", path);
+		return false;
+	}
+	if(error != ECONNREFUSED){
+		SDL_Log("Could not check %s : %s\n", path, strerror(error));
+		return false;
+	}
+	unlink(path);
+	return true;
+}
 
-	switch ((chip8->inst.opcode >> 12) & 0x0F){
-		case 0x00:
-			if(chip8->inst.NN == 0xE0){
-				memset(&chip8->display[0], false, sizeof chip8->display);
-			} else if(chip8->inst.NN == 0xEE){
-				chip8->PC = *--chip8->stack_ptr;
-			} else if(chip8->inst.N2 == 0x0C0){
-				for(int loop = 0; loop < 8192; loop++){
-					chip8->Destination[loop] = 0;
-				}
-				for(unsigned col = 0; col < config.window_width; col++){
-					for(unsigned row = 0; row < (config.window_height - chip8->inst.N); row++){
-						int source = col + (row * config.window_width);
-						int dest = col + ((row + chip8->inst.N) * config.window_width);
-						chip8->Destination[dest] = chip8->display[source];
-					}
-				}
-				for(int i = 0; i < 8192; i++){
-					chip8->display[i] = chip8->Destination[i];
-				}
-			} else if(chip8->inst.NN == 0xFB){
-				for(int loop = 0; loop < 8192; loop++){
-					chip8->Destination[loop] = 0;
-				}
-				for(unsigned col = 0; col < config.window_width - 4; col++){
-					for(unsigned row = 0; row < (config.window_height); row++){
-						int source = col + (row * config.window_width);
-						int dest = (col + 4) + (row * config.window_width);
-						chip8->Destination[dest] = chip8->display[source];
-					}
-				}
-				for(int i = 0; i < 8192; i++){
-					chip8->display[i] = chip8->Destination[i];
-				}
-			} else if (chip8->inst.NN == 0xFC){
-				for(int loop = 0; loop < 8192; loop++){
-					chip8->Destination[loop] = 0;
-				}
-				for(unsigned col = 0; col < config.window_width; col++){
-					for(unsigned row = 0; row < (config.window_height); row++){
-						int source = col + (row * config.window_width);
-						int dest = (col - 4) + (row * config.window_width);
-						chip8->Destination[dest] = chip8->display[source];
-					}
-				}
-				for(int i = 0; i < 8192; i++){
-					chip8->display[i] = chip8->Destination[i];
-				}
-			} else if(chip8->inst.NN == 0xFE){
-				config.super_mode = false;
-				config.window_height = 32;
-				config.window_width = 64;
-			} else if(chip8->inst.NN == 0xFF){
-				config.super_mode = true;
-				config.window_height = 64;
-				config.window_width = 128;
-			} else if(chip8->inst.NN == 0xFD){
-				exit(EXIT_SUCCESS);
-			}
-			break;
-		case 0x01:
-			chip8->PC = chip8->inst.NNN;
-			break;
-		case 0x02:
-			*chip8->stack_ptr++ = chip8->PC;
-			chip8->PC = chip8->inst.NNN;
-			break;
-		case 0x03:
-			if(chip8->V[chip8->inst.X] == chip8->inst.NN){
-				chip8->PC += 2;
-			}
-			break;
-		case 0x04:
-			if(chip8->V[chip8->inst.X] != chip8->inst.NN){
-				chip8->PC += 2;
-			}
-			break;
-		case 0x05:
-			if(chip8->inst.N != 0) break;
-			if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]){
-				chip8->PC += 2;
-			}
-			break;
-		case 0x06:
-			chip8->V[chip8->inst.X] = chip8->inst.NN;
-			break;
-		case 0x07:
-			chip8->V[chip8->inst.X] += chip8->inst.NN;
-			break;
-		case 0x08:
-			switch (chip8->inst.N){
-				case 0:
-					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-					break;
-				case 1:
-					chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-					break;
-				case 2:
-					chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-					break;
-				case 3:
-					chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-					break;
-				case 4:{
-					const bool carry = ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255);
-					chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-					chip8->V[0xF] = carry;
-					break;
-				}
-				case 5:
-					carry = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
-					chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-					chip8->V[0xF] = carry;
-					break;
-				case 6:
-					chip8->V[0xF] = chip8->V[chip8->inst.X] & 1;
-					chip8->V[chip8->inst.X] >>= 1;
-					break;
-				case 7:
-					carry = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
-					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-					chip8->V[0xF] = carry;
-					break;
-				case 0xE:
-					chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-					chip8->V[chip8->inst.X] <<= 1;
-					break;
-				default:
-					break;
-			}
-			break;
-		case 0x09:
-			if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
-				chip8->PC += 2;
-			break;
-		case 0x0A:
-			chip8->I = chip8->inst.NNN;
-			break;
-		case 0x0B:
-			chip8->PC = chip8->V[0] + chip8->inst.NNN;
-			break;
-		case 0x0C:
-			chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
-			break;
-		case 0x0D: {
-			uint8_t X_coord = chip8->V[chip8->inst.X] % config.window_width;
-			uint8_t Y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-			const uint8_t orig_X = X_coord;
-
-			chip8->V[0xF] = 0;
-			if(config.super_mode == false){
-				for(uint8_t i = 0; i < chip8->inst.N; i++){
-					const uint8_t sprite_data = chip8->ram[chip8->I + i];
-					X_coord = orig_X;
-				
-					for(int8_t j = 7; j >= 0; j--){
-						bool *pixel = &chip8->display[Y_coord * config.window_width + X_coord];
-						const bool sprite_bit = (sprite_data & (1 << j));
-						if(sprite_bit && *pixel){
-							chip8->V[0xF] = 1;
-						}
-						*pixel ^= sprite_bit;
+bool server_open(server_t *server, const char *path, const uint32_t workers, const uint32_t max_sessions){
+	memset(server, 0, sizeof(server_t));
+	server->listen_fd = -1;
+	server->max_sessions = max_sessions;
 
-						if(++X_coord >= config.window_width) break;
-					}
-					if(++Y_coord >= config.window_height) break;
-				}
-			} else if(config.super_mode == true){ 
-				if(chip8->inst.N == 0){
-					int offset = 0;
-					for(uint8_t i = 0; i < 16; i++){
-						const uint8_t sprite_data = (chip8->ram[chip8->I + offset] * 256) + (chip8->ram[chip8->I + (offset + 1)]);
-						offset += 2;
-						X_coord = orig_X;
-				
-						for(int8_t j = 0; j <16; j++){
-							bool *pixel = &chip8->display[Y_coord * config.window_width + X_coord];
-							const bool sprite_bit = (sprite_data & (0x8000 >> j));
-							if(sprite_bit && *pixel){
-								chip8->V[0xF] = 1;
-							}
-							*pixel ^= sprite_bit;
-
-							if(++X_coord >= config.window_width) break;
-						}
-						if(++Y_coord >= config.window_height) break;
-					}
-				} else {
-					for(uint8_t i = 0; i < chip8->inst.N; i++){
-					const uint8_t sprite_data = chip8->ram[chip8->I + i];
-					X_coord = orig_X;
-				
-						for(int8_t j = 7; j >= 0; j--){
-							bool *pixel = &chip8->display[Y_coord * config.window_width + X_coord];
-							const bool sprite_bit = (sprite_data & (1 << j));
-							if(sprite_bit && *pixel){
-								chip8->V[0xF] = 1;
-							}
-							*pixel ^= sprite_bit;
-
-							if(++X_coord >= config.window_width) break;
-						}
-						if(++Y_coord >= config.window_height) break;
-					}
-				}
-			}
-			break;
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if(strlen(path) >= sizeof addr.sun_path){
+		SDL_Log("Socket path %s is too long\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	if(!server_claim_path(path, &addr)) return false;
+
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	server->bound = server->listen_fd >= 0 && bind(server->listen_fd, (struct sockaddr *)&addr, sizeof addr) == 0;
+	if(!server->bound || listen(server->listen_fd, SOMAXCONN) != 0){
+		SDL_Log("Could not listen on %s : %s\n", path, strerror(errno));
+		return false;
+	}
+	fcntl(server->listen_fd, F_SETFL, fcntl(server->listen_fd, F_GETFL) | O_NONBLOCK);
+
+	server->sessions = malloc(max_sessions * sizeof(session_t *));
+	server->active = malloc(max_sessions * sizeof(session_t *));
+	server->fds = malloc((max_sessions + 1) * sizeof(struct pollfd));
+	server->workers = calloc(workers, sizeof(SDL_Thread *));
+	server->lock = SDL_CreateMutex();
+	server->start = SDL_CreateCond();
+	server->done = SDL_CreateCond();
+	if(!server->sessions || !server->active || !server->fds || !server->workers ||
+	   !server->lock || !server->start || !server->done){
+		SDL_Log("Could not allocate the server for %u sessions\n", max_sessions);
+		return false;
+	}
+	server->fds[0] = (struct pollfd){.fd = server->listen_fd, .events = POLLIN};
+
+	for(uint32_t i = 0; i < workers; i++){
+		server->workers[i] = SDL_CreateThread(server_worker_thread, "session_worker", server);
+		if(!server->workers[i]){
+			SDL_Log("Could not create worker thread %s\n", SDL_GetError());
+			return false;
 		}
-		case 0x0E:
-			if(chip8->inst.NN == 0x9E){
-				if(chip8->keypad[chip8->V[chip8->inst.X]])
-					chip8->PC += 2;
-			} else if(chip8->inst.NN == 0xA1){
-				if(!chip8->keypad[chip8->V[chip8->inst.X]])
-					chip8->PC += 2;
-			}
-			break;
-		case 0x0F:
-			switch (chip8->inst.NN) {
-				case 0x0A: {
-					bool any_key_pressed = false;
-					for(uint8_t i = 0; i < sizeof chip8->keypad; i++){
-						if(chip8->keypad[i]){
-							chip8->V[chip8->inst.X] = i;
-							any_key_pressed = true;
-							break;
-						}
-					}
-					if(!any_key_pressed)
-						chip8->PC -= 2;
-					break;
-				}
-				case 0x1E:
-					chip8->I += chip8->V[chip8->inst.X];
-					break;
-				case 0x07:
-					chip8->V[chip8->inst.X] = chip8->delay_timer;
-					break;
-				case 0x15:
-					chip8->delay_timer = chip8->V[chip8->inst.X];
-					break;
-				case 0x18:
-					chip8->sound_timer = chip8->V[chip8->inst.X];
-					break;
-				case 0x29:
-					chip8->I = chip8->V[chip8->inst.X] * 5;
-					break;
-				case 0x30:
-					chip8->I = 80 + (chip8->V[chip8->inst.X * 10]);
-					break;
-				case 0x33: {
-					uint8_t bcd = chip8->V[chip8->inst.X];
-					chip8->ram[chip8->I+2] = bcd % 10;
-					bcd /= 10;
-					chip8->ram[chip8->I+1] = bcd % 10;
-					bcd /= 10;
-					chip8->ram[chip8->I] = bcd;
-					break;
-				}
-				case 0x55:
-					for(uint8_t i = 0; i <= chip8->inst.X; i++)
-						chip8->ram[chip8->I + i] = chip8->V[i];
-					break;
-				case 0x65:
-					for(uint8_t i = 0; i <= chip8->inst.X; i++)
-						chip8->V[i] = chip8->ram[chip8->I + i];
-					break;
-				default:
-					break;
-			}
-			break;
-		default :
+		server->worker_count++;  // Only the threads started are joined on close
+	}
+	return true;
+}
+
+void server_close(server_t *server, const char *path){
+	if(server->lock){
+		SDL_LockMutex(server->lock);
+		server->stop = true;
+		SDL_CondBroadcast(server->start);
+		SDL_UnlockMutex(server->lock);
+	}
+	for(uint32_t i = 0; i < server->worker_count; i++)
+		SDL_WaitThread(server->workers[i], NULL);
+
+	while(server->count)
+		server_remove(server, server->count - 1);
+	if(server->listen_fd >= 0) close(server->listen_fd);
+	if(server->bound) unlink(path);
+
+	SDL_DestroyCond(server->done);
+	SDL_DestroyCond(server->start);
+	SDL_DestroyMutex(server->lock);
+	free(server->workers);
+	free(server->fds);
+	free(server->active);
+	free(server->sessions);
+}
+
+bool serve(const char *path, const uint32_t workers, const uint32_t max_sessions){
+	server_t server;
+	if(!server_open(&server, path, workers, max_sessions)){
+		server_close(&server, path);
+		return false;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, server_signal);
+	signal(SIGTERM, server_signal);
+	SDL_Log("Serving on %s, %u workers, up to %u sessions\n", path, workers, max_sessions);
+
+	char label[64];
+	const char *slash = strrchr(path, '/');
+	snprintf(label, sizeof label, "server %s", slash ? slash + 1 : path);
+	metrics_open(&server.metrics, label);
+
+	const uint64_t frequency = SDL_GetPerformanceFrequency();
+	const uint64_t frame_ticks = frequency / 60;
+	const uint64_t start = SDL_GetPerformanceCounter();
+
+	while(!server_quit){
+		// Wait for the next tick, or only for the sockets when every session is parked (waking up
+		// twice a second to keep the metrics fresh)
+		int timeout = server.metrics.shared ? 500 : -1;
+		if(server.active_count){
+			const uint64_t deadline = start + (server.tick + 1) * frame_ticks;
+			const uint64_t now = SDL_GetPerformanceCounter();
+			timeout = now >= deadline ? 0 : (int)((deadline - now) * 1000 / frequency) + 1;
+		}
+		for(uint32_t i = 0; i < server.count; i++)
+			server.fds[i + 1].events = POLLIN | (server.sessions[i]->out_size ? POLLOUT : 0);
+		const uint64_t poll_start = SDL_GetPerformanceCounter();
+		if(poll(server.fds, server.count + 1, timeout) < 0 && errno != EINTR){
+			SDL_Log("poll failed : %s\n", strerror(errno));
 			break;
+		}
+		server.sleep_ticks += SDL_GetPerformanceCounter() - poll_start;
+
+		for(uint32_t i = 0; i < server.count; i++){
+			if(server.fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) session_read(&server, server.sessions[i]);
+			if(server.fds[i + 1].revents & POLLOUT) session_write(server.sessions[i]);
+		}
+		if(server.fds[0].revents & POLLIN) server_accept(&server);
+
+		// Ticks that came too late are skipped, not caught up
+		const uint64_t tick = (SDL_GetPerformanceCounter() - start) / frame_ticks;
+		if(tick > server.tick){
+			if(server.active_count && tick > server.tick + 1) server.late_ticks += tick - server.tick - 1;
+			server.tick = tick;
+			server_tick(&server);
+		}
+
+		for(uint32_t i = server.count; i-- > 0;){
+			session_t *session = server.sessions[i];
+			session_write(session);
+			if(session->closing && !session->out_size) server_remove(&server, i);
+		}
+		server_metrics_update(&server);
 	}
+
+	metrics_close(&server.metrics);
+	SDL_Log("Server stopped, %llu late ticks\n", (unsigned long long)server.late_ticks);
+	server_close(&server, path);
+	return true;
+}
+#else
+bool serve(const char *path, const uint32_t workers, const uint32_t max_sessions){
+	(void)path;
+	(void)workers;
+	(void)max_sessions;
+	SDL_Log("The session server needs Unix domain sockets, it is not available on Windows\n");
+	return false;
 }
+#endif
 
 int main(int argc, char **argv){
 	// Default usage message for args
 	if(argc < 2){
-		fprintf(stderr, "Usage : %s <rom_name>\n", argv[0]);
+		fprintf(stderr, "Usage : %s <rom_name|source.8o> [--scale-factor N] [--ips N] [--quirks <profile>]\n"
+						"        [--pacing vsync|hybrid] [--upscale <filter>] [--crt off|scanlines|mask]\n"
+						"        [--trace <file>] [--record <file>] [--debug] [--remember]\n"
+						"        %s --decode-trace <file>\n"
+						"        %s --export-recording <file> <prefix|video.raw> [--from N] [--to N] [--scale-factor N]\n"
+						"        %s --serve <socket> [--workers N] [--max-sessions N]\n"
+						"        %s --validate <rom> [--quirks <profile>] [--block N] [--frames N] [--seed N]\n"
+						"        %s --fuzz [--quirks <profile>] [--block N] [--frames N] [--programs N] [--seed N]\n",
+						argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	// Initialize emulator config/options
+	// Offline trace decoder, no SDL needed
+	if(strcmp(argv[1], "--decode-trace") == 0){
+		if(argc < 3 || !decode_trace(argv[2])) exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	// Offline recording exporter
+	if(strcmp(argv[1], "--export-recording") == 0){
+		if(argc < 4) exit(EXIT_FAILURE);
+		uint32_t from = 0, to = UINT32_MAX, scale = 1;
+		for(int i = 4; i + 1 < argc; i += 2){
+			if(strncmp(argv[i], "--from", strlen("--from")) == 0) from = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+			else if(strncmp(argv[i], "--to", strlen("--to")) == 0) to = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+			else if(strncmp(argv[i], "--scale-factor", strlen("--scale-factor")) == 0) scale = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+		}
+		if(!scale || !export_recording(argv[2], argv[3], from, to, scale)) exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	// Lockstep comparison of the reference and fast interpreters, on a ROM or random programs
+	if(strcmp(argv[1], "--validate") == 0){
+		if(argc < 3 || !validate_rom(argv[2], argc, argv)) exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if(strcmp(argv[1], "--fuzz") == 0){
+		if(!fuzz(argc, argv)) exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	// Headless session server
+	if(strcmp(argv[1], "--serve") == 0){
+		if(argc < 3) exit(EXIT_FAILURE);
+		uint32_t workers = SDL_GetCPUCount(), max_sessions = 4096;
+		for(int i = 3; i + 1 < argc; i += 2){
+			if(strncmp(argv[i], "--workers", strlen("--workers")) == 0) workers = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+			else if(strncmp(argv[i], "--max-sessions", strlen("--max-sessions")) == 0) max_sessions = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+		}
+		if(!workers || !max_sessions || !serve(argv[2], workers, max_sessions)) exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	// Map the ROM and get what is already known about it
+	rom_t rom = {0};
+	if(!load_rom(&rom, argv[1], true)) exit(EXIT_FAILURE);
+
+	// Initialize emulator config/options, --remember keeps --ips and --quirks for the next launches
 	config_t config = {0};
-	if(!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
+	if(!set_config_from_args(&config, &rom.metadata, argc, argv)) exit(EXIT_FAILURE);
+	if(config.remember && (config.quirks != rom.metadata.quirks || config.insts_per_second != rom.metadata.insts_per_second)){
+		rom.metadata.quirks = config.quirks;
+		rom.metadata.insts_per_second = config.insts_per_second;
+		save_rom_metadata(&rom.metadata);
+	}
 
 	// Initialize SDL
 	sdl_t sdl = {0};
@@ -886,30 +5129,84 @@ int main(int argc, char **argv){
 
 	// Initialize CHIP8 machine
 	chip8_t chip8 = {0};
-	const char *rom_name = argv[1];
-	if(!init_chip8(&chip8, config, rom_name)) exit(EXIT_FAILURE);
+	if(!init_chip8(&chip8, config, &rom)) exit(EXIT_FAILURE);
+
+	// Pick the interpreter loop matching the quirk profile
+	const quirk_profile_t *quirks = &quirk_profiles[config.quirks];
+
+	// Start the binary trace writer
+	trace_t trace = {0};
+	if(config.trace_path && !trace_open(&trace, config.trace_path)) exit(EXIT_FAILURE);
+
+	// Start the gameplay recording writer
+	recording_t recording = {0};
+	if(config.record_path && !recording_open(&recording, config.record_path, config)) exit(EXIT_FAILURE);
+
+	// Breakpoints and watchpoints
+	static debugger_t debugger;
+	debugger.code_map = rom.metadata.code_map;
+	if(config.debug) chip8.state = STOPPED;
+
+	// Reassemble Octo sources when they are saved
+	source_watch_t watch;
+	watch_source(&watch, &rom);
+
+	// Frame pacing
+	pacer_t pacer;
+	init_pacer(&pacer, config.pacing, sdl.refresh_rate);
+
+	// Publish live metrics
+	metrics_t metrics;
+	metrics_open(&metrics, rom.name);
 
 	// Main loop
+	bool halted = false;
 	while (chip8.state != QUIT){
 		handle_input(&chip8, &config);
-		if(chip8.state == PAUSED) continue;
-
-		const uint64_t start_frame_time = SDL_GetPerformanceCounter();
+		if(source_changed(&watch, &rom)) hot_reload(&rom, &chip8);
+		// Events and metrics keep going while paused or in the debugger, the window stays responsive
+		if(chip8.state == STOPPED || chip8.state == PAUSED){
+			if(chip8.state == STOPPED) debugger_poll(&debugger, &chip8);
+			metrics_update(&metrics, &pacer, &chip8);
+			SDL_Delay(16);
+			halted = true;
+			continue;
+		}
+		if(halted){
+			pacer_resume(&pacer);
+			halted = false;
+		}
 
-		for(uint32_t i = 0; i < config.insts_per_second/60; i++)
-			emulate_instruction(&chip8, config);
+		uint32_t timer_ticks;
+		const uint32_t insts = pacer_begin_frame(&pacer, config, &timer_ticks);
 
-		const uint64_t end_frame_time = SDL_GetPerformanceCounter();
+		if(debugger_active(&debugger)){
+			debugger_run(&debugger, &chip8, config, insts, &trace);
+		} else if(trace.file){
+			for(uint32_t i = 0; i < insts; i++)
+				trace_instruction(&trace, &chip8, config);
+		} else {
+			quirks->emulate_instructions(&chip8, config, insts);
+		}
 
-		const double time_elapsed = (double)((end_frame_time - start_frame_time) * 1000) / SDL_GetPerformanceFrequency();
+		update_screen(sdl, config, &chip8);
+		if(config.show_overlay) draw_overlay(sdl, &pacer);
+		pacer_present(&pacer, sdl.renderer);
 
-		SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
+		// One recorded frame per 60 Hz tick, a slow frame merges ticks but the sound gate differs between them
+		for(uint32_t tick = timer_ticks; tick > 0; tick--){
+			if(recording.file) recording_capture(&recording, &chip8, pacer.frames_emulated + 1 - tick);
+			update_timers(sdl, &chip8);
+		}
 
-		update_screen(sdl, config, &chip8);
-		update_timers(sdl, &chip8);
+		metrics_update(&metrics, &pacer, &chip8);
 	}
 
 	// Final cleanup
+	trace_close(&trace);
+	recording_close(&recording);
+	metrics_close(&metrics);
+	unmap_rom(&rom);
 	final_cleanup(sdl);
 
 	exit(EXIT_SUCCESS);
@@ -0,0 +1,35 @@
+// Live metrics shared between a running chip8 and chip8-top.
+// Every instance publishes one block in a POSIX shared memory segment named CHIP8_METRICS_PREFIX<pid>,
+// a session server publishes one block for all its sessions.
+// The emulator is the only writer : fields are plain relaxed atomic stores done once per frame,
+// readers may see a frame where some counters are one update ahead of others.
+#ifndef CHIP8_METRICS_H
+#define CHIP8_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define CHIP8_METRICS_PREFIX "chip8-"
+#define CHIP8_METRICS_MAGIC 0x4D385043  // "CP8M"
+#define CHIP8_METRICS_VERSION 2
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	char rom_name[64];
+	atomic_uint_fast64_t start_ms;          // Wall clock time, ms since the epoch
+	atomic_uint_fast64_t update_ms;         // Last update, a stale value means a hung or dead instance
+	atomic_uint_fast32_t state;             // 0 QUIT, 1 RUNNING, 2 PAUSED, 3 STOPPED (debugger)
+	atomic_uint_fast32_t insts_per_second;  // Measured over the last second
+	atomic_uint_fast64_t insts;
+	atomic_uint_fast64_t frames_emulated;   // 60 Hz CHIP8 frames (timer ticks)
+	atomic_uint_fast64_t frames_presented;  // Frames shown on screen
+	atomic_uint_fast64_t late_frames;
+	atomic_uint_fast64_t sleep_us;          // Time spent waiting for the frame deadline
+	atomic_uint_fast64_t audio_underruns;
+	atomic_uint_fast64_t draws;             // DXYN executed
+	atomic_uint_fast32_t sessions;          // Games emulated : 1 for a window, the connected clients of chip8 --serve
+} chip8_metrics_t;
+
+#endif
@@ -0,0 +1,29 @@
+// Protocol between chip8 --serve and its clients, over a Unix domain stream socket.
+// Every message is a 4 byte header followed by its payload, all integers are little endian :
+//   uint8 type, uint8 reserved (0), uint16 payload size
+// One connection is one session. The session starts when the client sends a ROM, and ends when
+// either side closes the connection or the program exits (00FD). CXNN draws from a generator seeded
+// with the ROM hash, the same keypad messages at the same frames replay the same session.
+#ifndef CHIP8_SERVER_H
+#define CHIP8_SERVER_H
+
+#define CHIP8_SERVER_HEADER_SIZE 4
+#define CHIP8_SERVER_MAX_PAYLOAD (8 + 4096 - 0x200)
+
+// Client to server
+#define CHIP8_MSG_LOAD 0x01    // uint8 quirk profile (0xFF to guess it from the ROM), uint8 reserved, uint16 reserved,
+                               // uint32 instructions per second (0 for the default, at most 1000000), ROM bytes.
+                               // Sending it again restarts the session with the new ROM, frame numbers and deltas included.
+#define CHIP8_MSG_KEYPAD 0x02  // uint16 keypad state, bit n set while key n is pressed
+
+// Server to client
+#define CHIP8_MSG_FRAME 0x81   // uint32 frame, uint8 width, uint8 height, display delta. Sent only when the display changed.
+#define CHIP8_MSG_AUDIO 0x82   // uint32 frame, uint8 gate (1 while the sound timer runs). Sent when the gate changes.
+#define CHIP8_MSG_ERROR 0x83   // Text, the server closes the connection after it
+
+// Frames are numbered in 60 Hz ticks since the ROM was loaded. The display is 128x64 bits, MSB
+// first, row after row using the width of the frame. A delta is that bitmap XORed with the previous
+// one sent (all zero at the start and after every LOAD), run length encoded like gameplay recordings : a control byte
+// below 0x80 stands for control + 1 zero bytes, from 0x80 it is followed by control - 0x7F literal bytes.
+
+#endif
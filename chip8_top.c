@@ -0,0 +1,213 @@
+// chip8-top : live view of every running chip8, read from the shared memory blocks they publish
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "chip8_metrics.h"
+
+#define SHM_DIR "/dev/shm"
+#define STALE_MS 2000  // An instance that has not updated for this long is reported as hung
+
+typedef struct {
+	int32_t pid;
+	char rom_name[64];
+	uint32_t state;
+	uint32_t ips;
+	uint64_t start_ms;
+	uint64_t update_ms;
+	uint64_t insts;
+	uint64_t frames_emulated;
+	uint64_t frames_presented;
+	uint64_t late_frames;
+	uint64_t sleep_us;
+	uint64_t audio_underruns;
+	uint64_t draws;
+	uint32_t sessions;
+} snapshot_t;
+
+// Previous sample of each instance, to show rates between two refreshes
+typedef struct {
+	int32_t pid;
+	uint64_t frames_presented;
+	uint64_t late_frames;
+	uint64_t sleep_us;
+	uint64_t draws;
+} previous_t;
+
+uint64_t wall_clock_ms(void){
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Copy one instance's block, false if it is not a readable chip8 block
+bool read_instance(const char *name, snapshot_t *snap){
+	char path[300];
+	snprintf(path, sizeof path, "/%s", name);
+	const int fd = shm_open(path, O_RDONLY, 0);
+	if(fd < 0) return false;
+	chip8_metrics_t *shared = mmap(NULL, sizeof(chip8_metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shared == MAP_FAILED) return false;
+
+	bool ok = shared->magic == CHIP8_METRICS_MAGIC && shared->version == CHIP8_METRICS_VERSION;
+	if(ok){
+		atomic_thread_fence(memory_order_acquire);
+		snap->pid = shared->pid;
+		memcpy(snap->rom_name, shared->rom_name, sizeof snap->rom_name);
+		snap->rom_name[sizeof snap->rom_name - 1] = '\0';
+		snap->state = atomic_load_explicit(&shared->state, memory_order_relaxed);
+		snap->ips = atomic_load_explicit(&shared->insts_per_second, memory_order_relaxed);
+		snap->start_ms = atomic_load_explicit(&shared->start_ms, memory_order_relaxed);
+		snap->update_ms = atomic_load_explicit(&shared->update_ms, memory_order_relaxed);
+		snap->insts = atomic_load_explicit(&shared->insts, memory_order_relaxed);
+		snap->frames_emulated = atomic_load_explicit(&shared->frames_emulated, memory_order_relaxed);
+		snap->frames_presented = atomic_load_explicit(&shared->frames_presented, memory_order_relaxed);
+		snap->late_frames = atomic_load_explicit(&shared->late_frames, memory_order_relaxed);
+		snap->sleep_us = atomic_load_explicit(&shared->sleep_us, memory_order_relaxed);
+		snap->audio_underruns = atomic_load_explicit(&shared->audio_underruns, memory_order_relaxed);
+		snap->draws = atomic_load_explicit(&shared->draws, memory_order_relaxed);
+		snap->sessions = atomic_load_explicit(&shared->sessions, memory_order_relaxed);
+	}
+	munmap(shared, sizeof(chip8_metrics_t));
+	return ok;
+}
+
+// Blocks left behind by a crashed emulator are removed once their process is gone
+bool instance_alive(const snapshot_t *snap){
+	return kill(snap->pid, 0) == 0 || errno == EPERM;
+}
+
+// Read every instance, the array grows as needed
+int collect(snapshot_t **snaps, int *capacity){
+	DIR *dir = opendir(SHM_DIR);
+	if(!dir) return 0;
+
+	int count = 0;
+	const size_t prefix_len = strlen(CHIP8_METRICS_PREFIX);
+	struct dirent *entry;
+	while((entry = readdir(dir))){
+		if(strncmp(entry->d_name, CHIP8_METRICS_PREFIX, prefix_len) != 0) continue;
+		if(count == *capacity){
+			snapshot_t *grown = realloc(*snaps, (*capacity ? *capacity * 2 : 64) * sizeof(snapshot_t));
+			if(!grown){
+				fprintf(stderr, "Out of memory, only %d instances listed\n", count);
+				break;
+			}
+			*snaps = grown;
+			*capacity = *capacity ? *capacity * 2 : 64;
+		}
+		if(!read_instance(entry->d_name, &(*snaps)[count])) continue;
+		if(!instance_alive(&(*snaps)[count])){
+			char path[300];
+			snprintf(path, sizeof path, "/%s", entry->d_name);
+			shm_unlink(path);
+			continue;
+		}
+		count++;
+	}
+	closedir(dir);
+	return count;
+}
+
+const char *state_name(const snapshot_t *snap, uint64_t now){
+	if(now > snap->update_ms + STALE_MS) return "HUNG";
+	switch(snap->state){
+		case 1: return "RUN";
+		case 2: return "PAUSE";
+		case 3: return "DEBUG";
+		default: return "QUIT";
+	}
+}
+
+previous_t *find_previous(previous_t *previous, int count, int32_t pid){
+	for(int i = 0; i < count; i++)
+		if(previous[i].pid == pid) return &previous[i];
+	return NULL;
+}
+
+// previous holds the samples of the last refresh, it is replaced by this one
+void print_table(const snapshot_t *snaps, int count, previous_t **previous, int *previous_count, double interval){
+	const uint64_t now = wall_clock_ms();
+	previous_t *current = malloc((count ? count : 1) * sizeof(previous_t));
+	uint64_t total_ips = 0, total_insts = 0, total_late = 0, total_underruns = 0, total_sessions = 0;
+
+	printf("%-7s %-20s %-5s %6s %9s %8s %6s %6s %6s %7s %9s %8s\n",
+		"PID", "ROM", "STATE", "GAMES", "IPS", "UPTIME", "FPS", "LATE/s", "SLEEP%", "DRAW/s", "LATE", "UNDERRUN");
+	for(int i = 0; i < count; i++){
+		const snapshot_t *snap = &snaps[i];
+		const previous_t *prev = find_previous(*previous, *previous_count, snap->pid);
+		double fps = 0, late = 0, sleep = 0, draws = 0;
+		if(prev && interval > 0){
+			fps = (snap->frames_presented - prev->frames_presented) / interval;
+			late = (snap->late_frames - prev->late_frames) / interval;
+			sleep = (snap->sleep_us - prev->sleep_us) / (interval * 10000.0);
+			draws = (snap->draws - prev->draws) / interval;
+		}
+		const uint64_t uptime = snap->update_ms > snap->start_ms ? (snap->update_ms - snap->start_ms) / 1000 : 0;
+
+		printf("%-7d %-20.20s %-5s %6u %9u %5llu:%02llu %6.1f %6.1f %6.1f %7.0f %9llu %8llu\n",
+			snap->pid, snap->rom_name, state_name(snap, now), snap->sessions, snap->ips,
+			(unsigned long long)(uptime / 60), (unsigned long long)(uptime % 60),
+			fps, late, sleep, draws,
+			(unsigned long long)snap->late_frames, (unsigned long long)snap->audio_underruns);
+
+		if(current) current[i] = (previous_t){snap->pid, snap->frames_presented, snap->late_frames, snap->sleep_us, snap->draws};
+		total_sessions += snap->sessions;
+		total_ips += snap->ips;
+		total_insts += snap->insts;
+		total_late += snap->late_frames;
+		total_underruns += snap->audio_underruns;
+	}
+	printf("\n%d instance(s), %llu game(s), %llu instructions/s, %llu instructions, %llu late frames, %llu audio underruns\n",
+		count, (unsigned long long)total_sessions, (unsigned long long)total_ips, (unsigned long long)total_insts,
+		(unsigned long long)total_late, (unsigned long long)total_underruns);
+
+	free(*previous);
+	*previous = current;
+	*previous_count = current ? count : 0;
+}
+
+int main(int argc, char **argv){
+	bool once = false;
+	for(int i = 1; i < argc; i++){
+		if(strncmp(argv[i], "--once", strlen("--once")) == 0) once = true;
+		else{
+			fprintf(stderr, "Usage: %s [--once]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	snapshot_t *snaps = NULL;
+	int capacity = 0;
+	previous_t *previous = NULL;
+	int previous_count = 0;
+	uint64_t last_ms = 0;
+
+	for(;;){
+		const int count = collect(&snaps, &capacity);
+		const uint64_t now = wall_clock_ms();
+		if(!once) printf("\033[H\033[2J");  // Clear the terminal
+		print_table(snaps, count, &previous, &previous_count, last_ms ? (now - last_ms) / 1000.0 : 0);
+		fflush(stdout);
+		last_ms = now;
+		if(once) break;
+
+		const struct timespec second = {1, 0};
+		nanosleep(&second, NULL);
+	}
+
+	free(previous);
+	free(snaps);
+	return EXIT_SUCCESS;
+}